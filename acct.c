@@ -0,0 +1,207 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE /* be64toh() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_acct.h>
+
+#include "acct.h"
+
+extern int debug;
+extern int verbose;
+extern volatile sig_atomic_t stop_requested;
+extern volatile sig_atomic_t report_requested;
+
+/*
+ * Instead of queueing packets, the kernel counts them in an nfacct object
+ * and the counter is read at a fixed interval.  Matched packets never leave
+ * the kernel and no netlink traffic depends on the packet rate.
+ */
+static unsigned long polls = 0;
+static unsigned long moves = 0;
+static uint64_t counted = 0;
+
+static int acct_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, NFACCT_MAX) < 0)
+		return MNL_CB_OK;
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+static int acct_data_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *tb[NFACCT_MAX + 1] = {};
+	uint64_t *packets = data;
+
+	mnl_attr_parse(nlh, sizeof(struct nfgenmsg), acct_attr_cb, tb);
+	if (tb[NFACCT_PKTS] == NULL) {
+		fputs("No packet counter in nfacct message\n", stderr);
+		return MNL_CB_ERROR;
+	}
+
+	*packets = be64toh(mnl_attr_get_u64(tb[NFACCT_PKTS]));
+	return MNL_CB_OK;
+}
+
+static int read_counter(struct mnl_socket *nl, const char *name,
+			uint64_t *packets)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	static unsigned int seq = 0;
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfg;
+	ssize_t n;
+	int ret;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = (NFNL_SUBSYS_ACCT << 8) | NFNL_MSG_ACCT_GET;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_seq = ++seq;
+	nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+	nfg->nfgen_family = AF_UNSPEC;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = 0;
+	mnl_attr_put_strz(nlh, NFACCT_NAME, name);
+
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+		perror("mnl_socket_sendto");
+		return -1;
+	}
+
+	/* The object is followed by the acknowledgement */
+	do {
+		n = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("mnl_socket_recvfrom");
+			return -1;
+		}
+		ret = mnl_cb_run(buf, n, seq, mnl_socket_get_portid(nl),
+				 acct_data_cb, packets);
+	} while (ret > MNL_CB_STOP);
+
+	if (ret < 0) {
+		if (errno != ENOENT)
+			perror("nfacct");
+		return -1;
+	}
+	return 0;
+}
+
+static void print_stats(const struct acct_config *config, FILE *stream)
+{
+	fprintf(stream, "%lu polls of counter %s, %lu moves, %llu packets\n",
+		polls, config->name, moves, (unsigned long long)counted);
+	if (config->report != NULL)
+		config->report(stream);
+	fflush(stream);
+}
+
+/* Runs CALLBACK whenever the counter moved, until stop_requested is set */
+int acct_poll(const struct acct_config *config, acct_callback callback)
+{
+	struct mnl_socket *nl;
+	struct timespec next;
+	uint64_t last, packets;
+	int ret = EXIT_SUCCESS;
+
+	nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (nl == NULL) {
+		perror("mnl_socket_open");
+		return EXIT_FAILURE;
+	}
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		perror("mnl_socket_bind");
+		mnl_socket_close(nl);
+		return EXIT_FAILURE;
+	}
+
+	/* The first reading is only the baseline */
+	if (read_counter(nl, config->name, &last) < 0) {
+		if (errno == ENOENT)
+			fprintf(stderr, "No nfacct object named %s\n", config->name);
+		mnl_socket_close(nl);
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!stop_requested) {
+		next.tv_sec += config->interval_ms / 1000;
+		next.tv_nsec += (config->interval_ms % 1000) * 1000000L;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+
+		/* Signals interrupt the sleep to report or stop right away */
+		while (!stop_requested &&
+		       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				       NULL) == EINTR) {
+			if (report_requested) {
+				report_requested = 0;
+				print_stats(config, stdout);
+			}
+		}
+		if (stop_requested)
+			break;
+
+		if (read_counter(nl, config->name, &packets) < 0) {
+			if (errno != ENOENT) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+			/* Removed while the ruleset is reloaded */
+			if (debug && last != 0)
+				printf("Counter %s disappeared\n", config->name);
+			packets = 0;
+		}
+		polls++;
+
+		/* A reset or recreated counter starts from zero */
+		if (packets < last)
+			last = 0;
+		if (packets == last)
+			continue;
+
+		if (debug)
+			printf("Counter %s moved by %llu packets\n", config->name,
+			       (unsigned long long)(packets - last));
+		moves++;
+		counted += packets - last;
+		callback(packets - last);
+		last = packets;
+	}
+
+	if (verbose || debug)
+		print_stats(config, stdout);
+
+	mnl_socket_close(nl);
+	return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef ETHERWAKE_NFQUEUE_ACCT_H
+#define ETHERWAKE_NFQUEUE_ACCT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Called when the counter moved, with the packets counted since the last
+ * poll. */
+typedef void (*acct_callback)(uint64_t packets);
+
+struct acct_config {
+	/* Name of the nfacct object, as used with '--match nfacct' */
+	const char *name;
+	unsigned int interval_ms;
+	/* Prints further statistics after those of the counter, may be NULL */
+	void (*report)(FILE *stream);
+};
+
+int acct_poll(const struct acct_config *config, acct_callback callback);
+
+#endif //ETHERWAKE_NFQUEUE_ACCT_H
@@ -0,0 +1,195 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "control.h"
+
+#define COMMAND_SIZE 512
+/* A client that doesn't finish its command in time is dropped */
+#define CLIENT_TIMEOUT_S 5
+
+extern int debug;
+
+static const char *socket_path;
+static control_handler handler;
+static int listen_fd = -1;
+static int event_fd = -1;
+static pthread_t thread;
+static int running = 0;
+
+/*
+ * Clients send one command per line and get its output, followed by a line
+ * reading "ok" or "error".  They are served one after another, commands
+ * are rare and quick.
+ */
+static void serve_client(int fd)
+{
+	struct timeval timeout = { CLIENT_TIMEOUT_S, 0 };
+	char command[COMMAND_SIZE];
+	FILE *in, *out;
+	int out_fd;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	out_fd = dup(fd);
+	in = fdopen(fd, "r");
+	out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+	if (in == NULL || out == NULL) {
+		perror("fdopen");
+		if (in != NULL)
+			fclose(in);
+		else
+			close(fd);
+		if (out_fd >= 0 && out == NULL)
+			close(out_fd);
+		return;
+	}
+
+	while (fgets(command, sizeof(command), in) != NULL) {
+		command[strcspn(command, "\r\n")] = '\0';
+		if (command[0] == '\0')
+			continue;
+		if (debug)
+			printf("Control command: %s\n", command);
+		fputs(handler(command, out) ? "ok\n" : "error\n", out);
+		if (fflush(out) != 0)
+			break;
+	}
+
+	fclose(in);
+	fclose(out);
+}
+
+static void *control_thread(void *data)
+{
+	struct pollfd fds[2];
+	int fd;
+
+	(void)data;
+
+	fds[0].fd = listen_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = event_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+			break;
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			continue;
+		}
+		serve_client(fd);
+	}
+
+	return NULL;
+}
+
+/* Listen for commands on the Unix socket at PATH, which only root may use */
+int control_start(const char *path, control_handler callback)
+{
+	struct sockaddr_un addr;
+	sigset_t all, old;
+	mode_t mask;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path %s is too long\n", path);
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (listen_fd < 0 || event_fd < 0) {
+		perror("Failed creating control socket");
+		return false;
+	}
+
+	/* A stale socket of an earlier run would fail the bind */
+	unlink(path);
+	mask = umask(0077);
+	ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(listen_fd, 4) < 0) {
+		perror(path);
+		return false;
+	}
+	socket_path = path;
+	handler = callback;
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, control_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating control thread\n");
+		return false;
+	}
+	running = 1;
+	return true;
+}
+
+void control_stop()
+{
+	uint64_t one = 1;
+
+	if (running) {
+		if (write(event_fd, &one, sizeof(one)) < 0)
+			perror("write(eventfd)");
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+	if (socket_path != NULL)
+		unlink(socket_path);
+	socket_path = NULL;
+	if (listen_fd >= 0)
+		close(listen_fd);
+	if (event_fd >= 0)
+		close(event_fd);
+	listen_fd = event_fd = -1;
+}
@@ -0,0 +1,13 @@
+#ifndef ETHERWAKE_NFQUEUE_CONTROL_H
+#define ETHERWAKE_NFQUEUE_CONTROL_H
+
+#include <stdio.h>
+
+/* Runs one command received on the control socket and prints its output to
+ * REPLY.  Returns false when the command failed. */
+typedef int (*control_handler)(char *command, FILE *reply);
+
+int control_start(const char *path, control_handler handler);
+void control_stop();
+
+#endif //ETHERWAKE_NFQUEUE_CONTROL_H
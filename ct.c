@@ -0,0 +1,380 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/filter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "targets.h"
+#include "ct.h"
+
+extern int debug;
+extern int verbose;
+extern volatile sig_atomic_t stop_requested;
+extern volatile sig_atomic_t report_requested;
+
+/*
+ * New connections are taken from conntrack events instead of queued
+ * packets, so no connection waits for a verdict.  A socket filter drops
+ * events for other destinations in the kernel, before they are copied to
+ * the socket.  It is built again whenever the targets change.
+ */
+struct filter {
+	struct sock_filter insns[BPF_MAXINSNS];
+	unsigned int len;
+	/* Positions of the jumps to the port check */
+	unsigned int *accepts;
+	unsigned int accept_count;
+	unsigned int accept_size;
+	unsigned int v6_jump;
+	int overflow;
+};
+
+struct ct_stats {
+	unsigned long events;
+	unsigned long matched;
+	unsigned long overruns;
+};
+
+static struct ct_stats stats;
+static struct filter *filter;
+static ct_callback event_callback;
+
+/* Guards building and attaching the filter, and the socket while the
+   targets may change */
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mnl_socket *nl = NULL;
+static const struct ct_config *filter_config;
+
+static unsigned int emit(struct filter *f, uint16_t code, uint32_t k,
+			 uint8_t jt, uint8_t jf)
+{
+	if (f->len >= BPF_MAXINSNS) {
+		f->overflow = 1;
+		return f->len;
+	}
+	f->insns[f->len].code = code;
+	f->insns[f->len].jt = jt;
+	f->insns[f->len].jf = jf;
+	f->insns[f->len].k = k;
+	return f->len++;
+}
+
+/* A = offset of attribute X nested in the attribute at offset A,
+   the event is dropped when it is missing */
+static void emit_nested(struct filter *f, uint32_t type)
+{
+	emit(f, BPF_LDX | BPF_IMM, type, 0, 0);
+	emit(f, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR_NEST, 0, 0);
+	emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+	emit(f, BPF_RET | BPF_K, 0, 0, 0);
+}
+
+static void emit_accept_jump(struct filter *f)
+{
+	/* Targets may be added while the filter is built */
+	if (f->accept_count >= f->accept_size) {
+		f->overflow = 1;
+		return;
+	}
+	f->accepts[f->accept_count++] = emit(f, BPF_JMP | BPF_JA, 0, 0, 0);
+}
+
+static int add_v4(struct target *target)
+{
+	uint32_t addr;
+
+	if (target->family != AF_INET)
+		return 0;
+	memcpy(&addr, target->addr, 4);
+	emit(filter, BPF_JMP | BPF_JEQ | BPF_K, ntohl(addr), 0, 1);
+	emit_accept_jump(filter);
+	return 0;
+}
+
+static int add_v6(struct target *target)
+{
+	uint32_t words[4];
+	int i;
+
+	if (target->family != AF_INET6)
+		return 0;
+	memcpy(words, target->addr, 16);
+	/* X points to the address attribute, skip to the next target on
+	   the first word that differs */
+	for (i = 0; i < 4; i++) {
+		emit(filter, BPF_LD | BPF_W | BPF_IND, 4 + 4 * i, 0, 0);
+		emit(filter, BPF_JMP | BPF_JEQ | BPF_K, ntohl(words[i]), 0,
+		     (3 - i) * 2 + 1);
+	}
+	emit_accept_jump(filter);
+	return 0;
+}
+
+/* Accept events of connections to any target within the port range */
+static int build_filter(const struct ct_config *config)
+{
+	size_t count = targets_count();
+	unsigned int i, port_check;
+
+	filter = calloc(1, sizeof(*filter));
+	if (filter == NULL)
+		return -1;
+	filter->accepts = calloc(count ? count : 1, sizeof(*filter->accepts));
+	if (filter->accepts == NULL)
+		return -1;
+	filter->accept_size = count;
+
+	/* Original tuple, kept in M[0] for the port check */
+	emit(filter, BPF_LD | BPF_IMM, NLMSG_HDRLEN + sizeof(struct nfgenmsg),
+	     0, 0);
+	emit(filter, BPF_LDX | BPF_IMM, CTA_TUPLE_ORIG, 0, 0);
+	emit(filter, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR, 0, 0);
+	emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+	emit(filter, BPF_RET | BPF_K, 0, 0, 0);
+	emit(filter, BPF_ST, 0, 0, 0);
+
+	/* Addresses of the tuple, kept in M[1] for IPv6 */
+	emit_nested(filter, CTA_TUPLE_IP);
+	emit(filter, BPF_ST, 1, 0, 0);
+
+	/* IPv4 destination, otherwise continue with IPv6 */
+	emit(filter, BPF_LDX | BPF_IMM, CTA_IP_V4_DST, 0, 0);
+	emit(filter, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR_NEST, 0, 0);
+	emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+	filter->v6_jump = emit(filter, BPF_JMP | BPF_JA, 0, 0, 0);
+	emit(filter, BPF_MISC | BPF_TAX, 0, 0, 0);
+	emit(filter, BPF_LD | BPF_W | BPF_IND, 4, 0, 0);
+	targets_for_each(add_v4);
+	emit(filter, BPF_RET | BPF_K, 0, 0, 0);
+
+	filter->insns[filter->v6_jump].k = filter->len - filter->v6_jump - 1;
+	emit(filter, BPF_LD | BPF_MEM, 1, 0, 0);
+	emit_nested(filter, CTA_IP_V6_DST);
+	emit(filter, BPF_MISC | BPF_TAX, 0, 0, 0);
+	targets_for_each(add_v6);
+	emit(filter, BPF_RET | BPF_K, 0, 0, 0);
+
+	port_check = filter->len;
+	if (config->port_min != 0 || config->port_max != 0) {
+		emit(filter, BPF_LD | BPF_MEM, 0, 0, 0);
+		emit_nested(filter, CTA_TUPLE_PROTO);
+		emit_nested(filter, CTA_PROTO_DST_PORT);
+		emit(filter, BPF_MISC | BPF_TAX, 0, 0, 0);
+		emit(filter, BPF_LD | BPF_H | BPF_IND, 4, 0, 0);
+		emit(filter, BPF_JMP | BPF_JGE | BPF_K, config->port_min, 0, 2);
+		emit(filter, BPF_JMP | BPF_JGT | BPF_K, config->port_max, 1, 0);
+		emit(filter, BPF_RET | BPF_K, 0xffffffff, 0, 0);
+		emit(filter, BPF_RET | BPF_K, 0, 0, 0);
+	} else
+		emit(filter, BPF_RET | BPF_K, 0xffffffff, 0, 0);
+
+	for (i = 0; i < filter->accept_count; i++)
+		filter->insns[filter->accepts[i]].k =
+			port_check - filter->accepts[i] - 1;
+
+	return filter->overflow ? -1 : 0;
+}
+
+static int attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+
+	/* Attribute types are only valid per nesting level, no checks */
+	tb[mnl_attr_get_type(attr)] = attr;
+	return MNL_CB_OK;
+}
+
+static int parse_nested(const struct nlattr *nest, const struct nlattr **tb,
+			int max)
+{
+	memset(tb, 0, (max + 1) * sizeof(*tb));
+	return mnl_attr_parse_nested(nest, attr_cb, tb);
+}
+
+static int event_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlattr *tb[CTA_MAX + 1] = {};
+	const struct nlattr *tuple[CTA_TUPLE_MAX + 1];
+	const struct nlattr *ip[CTA_IP_MAX + 1];
+	const struct nlattr *proto[CTA_PROTO_MAX + 1];
+	const struct ct_config *config = data;
+	struct target *target = NULL;
+	uint16_t port = 0;
+
+	stats.events++;
+
+	mnl_attr_parse(nlh, sizeof(struct nfgenmsg), attr_cb, tb);
+	if (tb[CTA_TUPLE_ORIG] == NULL ||
+	    parse_nested(tb[CTA_TUPLE_ORIG], tuple, CTA_TUPLE_MAX) < 0 ||
+	    tuple[CTA_TUPLE_IP] == NULL ||
+	    parse_nested(tuple[CTA_TUPLE_IP], ip, CTA_IP_MAX) < 0)
+		return MNL_CB_OK;
+
+	/* The socket filter may be missing, check the port once more */
+	if (tuple[CTA_TUPLE_PROTO] != NULL &&
+	    parse_nested(tuple[CTA_TUPLE_PROTO], proto, CTA_PROTO_MAX) >= 0 &&
+	    proto[CTA_PROTO_DST_PORT] != NULL)
+		port = ntohs(mnl_attr_get_u16(proto[CTA_PROTO_DST_PORT]));
+	if ((config->port_min != 0 || config->port_max != 0) &&
+	    (port < config->port_min || port > config->port_max))
+		return MNL_CB_OK;
+
+	if (ip[CTA_IP_V4_DST] != NULL &&
+	    mnl_attr_get_payload_len(ip[CTA_IP_V4_DST]) == 4)
+		target = targets_lookup(AF_INET,
+					mnl_attr_get_payload(ip[CTA_IP_V4_DST]));
+	else if (ip[CTA_IP_V6_DST] != NULL &&
+		 mnl_attr_get_payload_len(ip[CTA_IP_V6_DST]) == 16)
+		target = targets_lookup(AF_INET6,
+					mnl_attr_get_payload(ip[CTA_IP_V6_DST]));
+	if (target == NULL)
+		return MNL_CB_OK;
+
+	stats.matched++;
+	if (debug)
+		printf("New connection to port %u of %s\n", port,
+		       ether_ntoa(&target->eaddr));
+	event_callback(target);
+	target_put(target);
+	return MNL_CB_OK;
+}
+
+static void print_stats(const struct ct_config *config, FILE *stream)
+{
+	fprintf(stream, "%lu connection events, %lu matched, %lu overruns\n",
+		stats.events, stats.matched, stats.overruns);
+	if (config->report != NULL)
+		config->report(stream);
+	fflush(stream);
+}
+
+/* Called with filter_lock held to filter events for the current targets */
+static void attach_filter()
+{
+	struct sock_fprog prog;
+	int fd = mnl_socket_get_fd(nl);
+
+	/* Without the filter, every event is checked in userspace */
+	if (build_filter(filter_config) < 0) {
+		if (verbose || debug)
+			fprintf(stderr, "Too many targets for the socket filter\n");
+		/* Fails when none was attached yet */
+		setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+	} else {
+		prog.len = filter->len;
+		prog.filter = filter->insns;
+		if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			       sizeof(prog)) < 0)
+			perror("setsockopt(SO_ATTACH_FILTER)");
+		else if (debug)
+			printf("Attached socket filter of %u instructions\n",
+			       filter->len);
+	}
+	if (filter != NULL)
+		free(filter->accepts);
+	free(filter);
+	filter = NULL;
+}
+
+/* Let events for targets that were added or removed through, may be
+   called from any thread */
+void ct_targets_changed()
+{
+	pthread_mutex_lock(&filter_lock);
+	if (nl != NULL)
+		attach_filter();
+	pthread_mutex_unlock(&filter_lock);
+}
+
+/* Runs CALLBACK for new connections to the targets until stop_requested
+   is set */
+int ct_receive(const struct ct_config *config, ct_callback callback)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct mnl_socket *sock;
+	int group = NFNLGRP_CONNTRACK_NEW;
+	int ret = EXIT_SUCCESS;
+	ssize_t n;
+
+	event_callback = callback;
+
+	sock = mnl_socket_open(NETLINK_NETFILTER);
+	if (sock == NULL) {
+		perror("mnl_socket_open");
+		return EXIT_FAILURE;
+	}
+	if (mnl_socket_bind(sock, 0, MNL_SOCKET_AUTOPID) < 0 ||
+	    mnl_socket_setsockopt(sock, NETLINK_ADD_MEMBERSHIP, &group,
+				  sizeof(group)) < 0) {
+		perror("Subscribing to conntrack events");
+		mnl_socket_close(sock);
+		return EXIT_FAILURE;
+	}
+
+	if (config->rcvbuf > 0 &&
+	    setsockopt(mnl_socket_get_fd(sock), SOL_SOCKET, SO_RCVBUFFORCE,
+		       &config->rcvbuf, sizeof(config->rcvbuf)) < 0 &&
+	    setsockopt(mnl_socket_get_fd(sock), SOL_SOCKET, SO_RCVBUF,
+		       &config->rcvbuf, sizeof(config->rcvbuf)) < 0)
+		perror("setsockopt(SO_RCVBUF)");
+
+	pthread_mutex_lock(&filter_lock);
+	nl = sock;
+	filter_config = config;
+	attach_filter();
+	pthread_mutex_unlock(&filter_lock);
+
+	while (!stop_requested) {
+		n = mnl_socket_recvfrom(sock, buf, sizeof(buf));
+		if (report_requested) {
+			report_requested = 0;
+			print_stats(config, stdout);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Events were lost, later connections still count */
+			if (errno == ENOBUFS) {
+				stats.overruns++;
+				continue;
+			}
+			perror("mnl_socket_recvfrom");
+			ret = EXIT_FAILURE;
+			break;
+		}
+		mnl_cb_run(buf, n, 0, 0, event_cb, (void *)config);
+	}
+
+	if (verbose || debug)
+		print_stats(config, stdout);
+
+	pthread_mutex_lock(&filter_lock);
+	nl = NULL;
+	pthread_mutex_unlock(&filter_lock);
+	mnl_socket_close(sock);
+	return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef ETHERWAKE_NFQUEUE_CT_H
+#define ETHERWAKE_NFQUEUE_CT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct target;
+
+/* Called for every new connection to one of the targets */
+typedef void (*ct_callback)(struct target *target);
+
+struct ct_config {
+	/* Destination port range of new connections, 0 for any port */
+	uint16_t port_min;
+	uint16_t port_max;
+	/* Netlink socket receive buffer in bytes, 0 for the system default */
+	int rcvbuf;
+	/* Prints further statistics after those of the events, may be NULL */
+	void (*report)(FILE *stream);
+};
+
+int ct_receive(const struct ct_config *config, ct_callback callback);
+void ct_targets_changed();
+
+#endif //ETHERWAKE_NFQUEUE_CT_H
@@ -3,10 +3,18 @@
 static char version_msg[] =
 "etherwake-nfqueue.c: v1.09-n1 based on v1.09 11/12/2003 Donald Becker, http://www.scyld.com/";
 static char brief_usage_msg[] =
-"usage: etherwake-nfqueue [-i <ifname>] [-p aa:bb:cc:dd[:ee:ff]] [-q <nfqueue_num>] 00:11:22:33:44:55\n"
+"usage: etherwake-nfqueue [-a] [-i <ifname>] [-p aa:bb:cc:dd[:ee:ff]] [-q <nfqueue_num>] 00:11:22:33:44:55\n"
+"       etherwake-nfqueue -m -q <nfqueue_num> [options] <host-id>=<ip-address> ...\n"
+"       etherwake-nfqueue -m [options] <host-id>=<ip-address> ...\n"
+"       etherwake-nfqueue -m -e [-P <port>[:<port>]] [options] <host-id>=<ip-address> ...\n"
+"       etherwake-nfqueue -c <counter> [options] 00:11:22:33:44:55\n"
 "   Use '-u' to see the complete set of options.\n";
 static char usage_msg[] =
-"usage: etherwake-nfqueue [-i <ifname>] [-p aa:bb:cc:dd[:ee:ff]] [-q <nfqueue_num>] 00:11:22:33:44:55\n"
+"usage: etherwake-nfqueue [-a] [-i <ifname>] [-p aa:bb:cc:dd[:ee:ff]] [-q <nfqueue_num>] 00:11:22:33:44:55\n"
+"       etherwake-nfqueue -m -q <nfqueue_num> [options] <host-id>=<ip-address> ...\n"
+"       etherwake-nfqueue -m [options] <host-id>=<ip-address> ...\n"
+"       etherwake-nfqueue -m -e [-P <port>[:<port>]] [options] <host-id>=<ip-address> ...\n"
+"       etherwake-nfqueue -c <counter> [options] 00:11:22:33:44:55\n"
 "\n"
 "	This program generates and transmits a Wake-On-LAN (WOL)\n"
 "	\"Magic Packet\", used for restarting machines that have been\n"
@@ -20,11 +28,43 @@ static char usage_msg[] =
 "	machine is awake.\n"
 "\n"
 "	Options:\n"
+"		-a	Accept queued packets right away and send wake-up packets\n"
+"			from a separate thread.\n"
 "		-b	Send wake-up packet to the broadcast address.\n"
+"		-B ifname[,ifname...]	With '-d' or '-H', also broadcast wake-up\n"
+"				packets on these interfaces when a host doesn't\n"
+"				respond to the first three.\n"
+"		-c name	Send wake-up packet when the nfacct counter NAME moved,\n"
+"			instead of acting on a NFQUEUE.\n"
+"		-e	With '-m', send wake-up packet on new connections to a\n"
+"			target reported by conntrack, instead of acting on a NFQUEUE.\n"
+"		-P port[:port]	With '-e', only consider connections to PORT\n"
+"				or the given range of ports.\n"
+"		-I ms	Read the counter every MS milliseconds (default 1000).\n"
+"		-n count	Send COUNT copies of each wake-up packet.\n"
+"		-U addr[:port]	Send the wake-up packet over UDP to ADDR, e.g. a\n"
+"				subnet-directed broadcast, and PORT (default 9).\n"
+"				With '-m', ADDR may be left out to send to each\n"
+"				target's address, or to the broadcast address of\n"
+"				its subnet when given as <ip-address>/<prefix>.\n"
+"		-C ms[:ms]	Send at most one wake-up packet per MS milliseconds\n"
+"				to a host that is waking up (default 10000).\n"
+"				The second value is how long a host that responded\n"
+"				is assumed to stay awake (default 60000).\n"
 "		-D	Increase the debug level.\n"
 "		-i ifname	Use interface IFNAME instead of the default 'eth0'.\n"
+"		-m	Wake multiple targets given as <host-id>=<ip-address>,\n"
+"			optionally followed by @<ifname> for another interface.\n"
+"			Without '-q' or '-e', all of them are woken at once.\n"
+"			The target is selected by the destination address\n"
+"			of the queued packet.\n"
+"		-H	With '-m', defer delivery of matched packets until\n"
+"			the target responds to a ping at its address.\n"
 "		-d ipaddress	Defer delivery of matched packets until host with IPADDRESS\n"
 "				responds to a ping i.e. has woken up.\n"
+"		-N	With '-d' or '-H', wait for the host's MAC address to become\n"
+"			reachable in the neighbour table instead of pinging it.\n"
+"			'-d' then takes a numeric address.\n"
 "		-p <pw>		Append the four or six byte password PW to the packet.\n"
 "					A password is only required for a few adapter types.\n"
 "					The password may be specified in ethernet hex format\n"
@@ -32,7 +72,39 @@ static char usage_msg[] =
 "		-p 00:22:44:66:88:aa\n"
 "		-p 192.168.1.1\n"
 "		-q 0		Send wake-up packet when any packet was received\n"
-"				in the specified NFQUEUE\n";
+"				in the specified NFQUEUE\n"
+"		-q 0:3		Receive from NFQUEUEs 0 to 3, each in its own thread\n"
+"				pinned to the matching CPU\n"
+"		-W ms		With '-d', don't block the queue while the host wakes up.\n"
+"			Park matched packets for at most MS milliseconds and\n"
+"			release them once the host responds.\n"
+"		-X		Drop instead of accept parked packets when they expire.\n"
+"		-Q len		Let at most LEN packets wait in the NFQUEUE.\n"
+"		-R bytes	Set the netlink receive buffer to BYTES.\n"
+"		-O		Count packets the kernel lost or let pass the queue,\n"
+"			and shed load while falling behind: packets for awake\n"
+"			hosts skip the rules and nothing is held.\n"
+"		-k mark[/mask]	Set the conntrack mark MARK on connections that\n"
+"				woke a host, so the firewall can stop queueing them.\n"
+"		-K		With '-k' and '-d' or '-H', also mark connections to\n"
+"			hosts that responded.\n"
+"		-F file	Only wake for packets selected by the rules in FILE.\n"
+"			Copies the first 64 bytes of each packet.\n"
+"		-E file	Look up host IDs in FILE, with lines like /etc/ethers or\n"
+"			<name>,<ip>,<mac>[,<interface>[,<password>]]. With '-m'\n"
+"			and no targets, all hosts with an IP address are woken.\n"
+"			Changes to FILE are picked up while running.\n"
+"		-S path	With '-m' and '-q', take commands on the Unix socket PATH:\n"
+"			add <host-id>=<ip-address>, remove <ip-address>,\n"
+"			password <pw>|none, cooldown <ms>[:<ms>], list, stats.\n"
+"		-L file	Learn when each host is used per 15 minutes of the week,\n"
+"			kept in FILE, and wake it ahead of times it was used\n"
+"			in at least two recent weeks.\n"
+"		-A min	With '-L', wake hosts MIN minutes ahead (default 5).\n"
+"		-M file	Write counters and latency histograms to FILE every\n"
+"			10 seconds, for the Prometheus node exporter.\n"
+"\n"
+"	When acting on a NFQUEUE or counter, send SIGUSR1 to print statistics.\n";
 
 /*
 	This program generates and transmits a Wake-On-LAN (WOL) "Magic Packet",
@@ -67,26 +139,39 @@ static char usage_msg[] =
   filter.  That configuration consumes more power.
 */
 
+#define _GNU_SOURCE /* sendmmsg() */
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <sys/socket.h>
+#include <arpa/inet.h>
 
-#include <sys/ioctl.h>
-#include <linux/if.h>
 
 #include <netpacket/packet.h>
 #include <net/ethernet.h>
 #include <netinet/ether.h>
 
 #include "nfqueue.h"
+#include "acct.h"
+#include "ct.h"
 #include "hold.h"
+#include "ping.h"
+#include "wake.h"
+#include "targets.h"
+#include "metrics.h"
+#include "match.h"
+#include "control.h"
+#include "hostdb.h"
+#include "prewake.h"
+#include "links.h"
 
-u_char outpack[1000];
-int pktsize;
 int s;				/* raw socket */
 
 #if defined(PF_PACKET)
@@ -96,46 +181,244 @@ struct sockaddr whereto;	/* who to wake up */
 #endif
 
 int debug = 0;
+int verbose = 0;
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t report_requested = 0;
 u_char wol_passwd[6];
 int wol_passwd_sz = 0;
 
 static int hold = 0;
+static int opt_hold_targets = 0;
+static int opt_hold_backend = HOLD_PING;
+static int opt_async = 0;
+static int opt_multi = 0;
+static unsigned int opt_park_timeout = 0;
+static int opt_park_drop = 0;
+static unsigned int opt_waking_cooldown = DEFAULT_WAKING_COOLDOWN_MS;
+static unsigned int opt_awake_cooldown = DEFAULT_AWAKE_COOLDOWN_MS;
 
 static int opt_no_src_addr = 0, opt_broadcast = 0;
+
+/* Hosts that don't respond get magic packets broadcast from this attempt
+   on, and on the interfaces given with '-B' from the next one */
+#define RETRY_BROADCAST 3
+#define RETRY_OTHER_INTERFACES 4
+#define MAX_OTHER_INTERFACES 8
+static char *opt_other_ifnames = NULL;
+static struct link *other_links[MAX_OTHER_INTERFACES];
+static int other_count = 0;
 static int opt_nfqueue_num = -1;
+static int opt_nfqueue_count = 1;
+static const char *opt_counter = NULL;
+static unsigned int opt_counter_interval = 1000;
+static int opt_events = 0;
+static uint16_t opt_port_min = 0, opt_port_max = 0;
+
+/* Send the magic packets over UDP instead of raw Ethernet frames */
+static int opt_udp = 0;
+static struct sockaddr_in udp_dest;
+/* The frame starts with the Ethernet header, not used with UDP */
+#define UDP_PAYLOAD_OFFSET 14
+
+/* Copies of each magic packet */
+static unsigned int opt_burst = 1;
+/* Most packets handed to the kernel with one sendmmsg() */
+#define SEND_BATCH 256
+
+static struct {
+	unsigned long batches;
+	unsigned long frames;
+	unsigned long errors;
+	unsigned long retries;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} send_stats;
+
+/* Rules selecting the packets that may wake a target */
+static const char *opt_rules;
 
-static int send_magic_packet();
-static int send_magic_packet_wait_online();
+/* Conntrack mark bits for flows that no longer need to be queued */
+static uint32_t opt_flow_mark = 0, opt_flow_mask = 0;
+/* Mark flows to hosts known to be awake, not just those that woke them */
+static int opt_mark_awake = 0;
+
+/* Where the times hosts are used are learned, see prewake.c */
+static const char *opt_learn;
+static unsigned int opt_lead = DEFAULT_PREWAKE_LEAD_S;
+static unsigned long prewakes = 0;
+
+/* Unix socket taking commands to change targets at runtime */
+static const char *opt_control;
+/* Serializes changes of targets from the control socket and hosts file */
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Host database, used instead of ether_hostton() */
+static const char *opt_hosts;
+/* Set when the targets are the hosts in the database */
+static int hosts_targets = 0;
+
+/* Prometheus text file rewritten every METRICS_INTERVAL seconds */
+static const char *opt_metrics;
+#define METRICS_INTERVAL 10
+
+static char *ifname = "eth0";
+/* The interface of '-i', only set when sending or probing needs one */
+static struct link *default_link;
+static u_char src_hwaddr[6];
+/* The target given on the command line without '-m' */
+/* Never freed, see target_get() */
+static struct target single_target = { .refs = 1 };
+
+static int send_magic_packets(struct target **targets, unsigned int count);
+static int wake_targets(void **args, unsigned int count);
+static int wake_queued(void **args, unsigned int count);
+static int wake_target(struct target *target);
+static int wake_all_targets();
+static int handle_packet(struct nfqueue_packet *packet);
+static int target_online(void *key);
+static void target_unparked(void *key);
 static int get_dest_addr(const char *arg, struct ether_addr *eaddr);
+static struct target *new_target(const char *arg);
+static struct target *create_target(const char *hostid, int family,
+									const unsigned char *addr,
+									const struct ether_addr *eaddr, int prefix,
+									const char *target_ifname);
+static int add_targets(char **args, unsigned int count);
+static void host_changed(const struct hostdb_entry *old,
+						 const struct hostdb_entry *entry);
+static int handle_control(char *command, FILE *reply);
 static int get_fill(unsigned char *pkt, struct ether_addr *eaddr);
+static int build_packet(unsigned char *pkt, struct ether_addr *eaddr,
+						const u_char *passwd, int passwd_sz);
+static int build_target_packet(struct target *target);
+static int add_hold_target(struct target *target);
+static void target_probed(struct target *target, int online);
+static void print_report(FILE *stream);
+static void write_metrics(FILE *stream);
+static void counter_moved(uint64_t packets);
+static void retry_magic_packet(struct target *target, unsigned int attempt);
+static int get_other_interfaces(char *ifnames);
+static void prewake_targets();
+static void connection_new(struct target *target);
+static int get_port_range(const char *optarg);
+static int get_udp_dest(const char *optarg);
+static int get_cooldown(const char *optarg);
+static int get_flow_mark(const char *optarg);
 static int get_wol_pw(const char *optarg);
 static int get_nfqueue_num(const char *optarg);
+static int get_ulong(const char *optarg, unsigned long max,
+					 unsigned long *val);
+static void install_signal_handlers();
 
 int main(int argc, char *argv[])
 {
-	char *ifname = "eth0";
-	char *ip_address;
+	char *ip_address = NULL;
 	int one = 1;				/* True, for socket options. */
-	int errflag = 0, nfqueue_errflag = 0, verbose = 0, do_version = 0;
+	int errflag = 0, nfqueue_errflag = 0, do_version = 0;
 	int perm_failure = 0;
 	int i, c, ret;
 	struct ether_addr eaddr;
-	int(*send_function)() = &send_magic_packet;
+	struct nfqueue_config nfqueue_config = { 0, };
+	unsigned long val;
 
-	while ((c = getopt(argc, argv, "bDi:d:p:q:uvV")) != -1)
+	while ((c = getopt(argc, argv, "aA:bB:c:C:DeE:i:d:F:HI:k:KL:mM:n:NOp:P:q:Q:R:S:uU:vVW:X")) != -1)
 		switch (c) {
+		case 'a': opt_async++;		break;
+		case 'A':
+			if (get_ulong(optarg, 24 * 60, &val) < 0) {
+				fprintf(stderr, "Invalid lead time %s\n", optarg);
+				errflag++;
+			} else
+				opt_lead = val * 60;
+			break;
 		case 'b': opt_broadcast++;	break;
+		case 'B': opt_other_ifnames = optarg; break;
+		case 'c': opt_counter = optarg; break;
+		case 'C':
+			if (get_cooldown(optarg) < 0) {
+				fprintf(stderr, "Invalid cool-down %s\n", optarg);
+				errflag++;
+			}
+			break;
 		case 'D': debug++;			break;
+		case 'e': opt_events++;		break;
+		case 'E': opt_hosts = optarg; break;
 		case 'i': ifname = optarg;	break;
 		case 'd': hold++; ip_address = optarg; break;
+		case 'k':
+			if (get_flow_mark(optarg) < 0) {
+				fprintf(stderr, "Invalid mark %s\n", optarg);
+				errflag++;
+			}
+			break;
+		case 'K': opt_mark_awake++;	break;
+		case 'L': opt_learn = optarg; break;
+		case 'F': opt_rules = optarg; break;
+		case 'H': hold++; opt_hold_targets++; break;
+		case 'I':
+			if (get_ulong(optarg, INT32_MAX, &val) < 0 || val == 0) {
+				fprintf(stderr, "Invalid interval %s\n", optarg);
+				errflag++;
+			} else
+				opt_counter_interval = val;
+			break;
+		case 'm': opt_multi++;		break;
+		case 'M': opt_metrics = optarg; break;
+		case 'n':
+			if (get_ulong(optarg, 100, &val) < 0 || val == 0) {
+				fprintf(stderr, "Invalid number of copies %s\n", optarg);
+				errflag++;
+			} else
+				opt_burst = val;
+			break;
+		case 'N': opt_hold_backend = HOLD_NEIGH; break;
+		case 'O': nfqueue_config.overload++; break;
 		case 'p': get_wol_pw(optarg); break;
+		case 'P':
+			if (get_port_range(optarg) < 0) {
+				fprintf(stderr, "Invalid port range %s\n", optarg);
+				errflag++;
+			}
+			break;
 		case 'q':
-			if (get_nfqueue_num(optarg) < 0)
+			ret = get_nfqueue_num(optarg);
+			if (ret == -2)
+				errflag++;
+			else if (ret < 0)
 				nfqueue_errflag++;
 			break;
+		case 'Q':
+			if (get_ulong(optarg, UINT32_MAX, &val) < 0) {
+				fprintf(stderr, "Invalid queue length %s\n", optarg);
+				errflag++;
+			} else
+				nfqueue_config.queue_maxlen = val;
+			break;
+		case 'S': opt_control = optarg; break;
+		case 'R':
+			if (get_ulong(optarg, INT32_MAX, &val) < 0) {
+				fprintf(stderr, "Invalid receive buffer size %s\n", optarg);
+				errflag++;
+			} else
+				nfqueue_config.rcvbuf = val;
+			break;
 		case 'u': printf("%s", usage_msg); return 0;
+		case 'U':
+			if (get_udp_dest(optarg) < 0) {
+				fprintf(stderr, "Invalid UDP destination %s\n", optarg);
+				errflag++;
+			}
+			break;
 		case 'v': verbose++;		break;
 		case 'V': do_version++;		break;
+		case 'W':
+			if (get_ulong(optarg, INT32_MAX, &val) < 0 || val == 0) {
+				fprintf(stderr, "Invalid hold time %s\n", optarg);
+				errflag++;
+			} else
+				opt_park_timeout = val;
+			break;
+		case 'X': opt_park_drop++;	break;
 		case '?':
 			errflag++;
 		}
@@ -146,21 +429,108 @@ int main(int argc, char *argv[])
 		return 3;
 	}
 	if (nfqueue_errflag) {
-		fprintf(stderr, "The '-q' option needs a value between 0 and 65535\n");
+		fprintf(stderr, "The '-q' option needs a value or range between 0 and 65535\n");
+		return 3;
+	}
+	if (optind == argc && ! (opt_multi && opt_hosts)) {
+		if (opt_multi)
+			fprintf(stderr, "Specify the targets as 00:11:22:33:44:55=192.168.0.10.\n");
+		else
+			fprintf(stderr, "Specify the Ethernet address as 00:11:22:33:44:55.\n");
+		return 3;
+	}
+	if (opt_events && (! opt_multi || opt_nfqueue_num >= 0 || opt_counter ||
+					   hold || opt_async)) {
+		fprintf(stderr, "The '-e' option requires the '-m' option and can't be "
+				"combined with '-q', '-c', '-H' or '-a'\n");
+		return 3;
+	}
+	if (opt_metrics && opt_nfqueue_num < 0 && ! opt_counter && ! opt_events) {
+		fprintf(stderr, "The '-M' option requires the '-q', '-c' or '-e' "
+				"option\n");
+		return 3;
+	}
+	if (opt_control && (! opt_multi || opt_nfqueue_num < 0)) {
+		fprintf(stderr, "The '-S' option requires the '-m' and '-q' options\n");
+		return 3;
+	}
+	if (nfqueue_config.overload && opt_nfqueue_num < 0) {
+		fprintf(stderr, "The '-O' option requires the '-q' option\n");
+		return 3;
+	}
+	if (opt_flow_mask && (opt_nfqueue_num < 0 || opt_async)) {
+		fprintf(stderr, "The '-k' option requires the '-q' option and can't "
+				"be combined with '-a'\n");
+		return 3;
+	}
+	if (opt_mark_awake && (! opt_flow_mask || ! hold)) {
+		fprintf(stderr, "The '-K' option requires the '-k' option and the "
+				"'-d' or '-H' option\n");
+		return 3;
+	}
+	if (opt_learn && opt_nfqueue_num < 0 && ! opt_counter && ! opt_events) {
+		fprintf(stderr, "The '-L' option requires the '-q', '-c' or '-e' "
+				"option\n");
+		return 3;
+	}
+	if (opt_lead != DEFAULT_PREWAKE_LEAD_S && ! opt_learn) {
+		fprintf(stderr, "The '-A' option requires the '-L' option\n");
+		return 3;
+	}
+	if (opt_rules && opt_nfqueue_num < 0) {
+		fprintf(stderr, "The '-F' option requires the '-q' option\n");
+		return 3;
+	}
+	if ((opt_port_min || opt_port_max) && ! opt_events) {
+		fprintf(stderr, "The '-P' option requires the '-e' option\n");
+		return 3;
+	}
+	if (opt_counter && (opt_nfqueue_num >= 0 || opt_multi || hold ||
+						opt_async)) {
+		fprintf(stderr, "The '-c' option can't be combined with '-q', '-m', "
+				"'-d', '-H' or '-a'\n");
 		return 3;
 	}
-	if (optind == argc) {
-		fprintf(stderr, "Specify the Ethernet address as 00:11:22:33:44:55.\n");
+	if (opt_udp && ! opt_multi && udp_dest.sin_addr.s_addr == INADDR_ANY) {
+		fprintf(stderr, "Give the '-U' option an address without '-m'\n");
+		return 3;
+	}
+	if (opt_multi && hold && ! opt_hold_targets) {
+		fprintf(stderr, "Use '-H' instead of '-d' with '-m'\n");
+		return 3;
+	}
+	if (opt_hold_targets && ! opt_multi) {
+		fprintf(stderr, "The '-H' option requires the '-m' option\n");
+		return 3;
+	}
+	if (opt_hold_backend == HOLD_NEIGH && ! hold) {
+		fprintf(stderr, "The '-N' option requires the '-d' or '-H' option\n");
+		return 3;
+	}
+	if (opt_other_ifnames && (! hold || opt_udp)) {
+		fprintf(stderr, "The '-B' option requires the '-d' or '-H' option "
+				"and can't be combined with '-U'\n");
+		return 3;
+	}
+	if (opt_park_timeout && ! hold) {
+		fprintf(stderr, "The '-W' option requires the '-d' or '-H' option\n");
+		return 3;
+	}
+	if (opt_park_timeout && opt_async) {
+		fprintf(stderr, "The '-W' option can't be combined with '-a'\n");
 		return 3;
 	}
 
 	/* Note: PF_INET, SOCK_DGRAM, IPPROTO_UDP would allow SIOCGIFHWADDR to
 	   work as non-root, but we need SOCK_PACKET to specify the Ethernet
 	   destination address. */
+	if (opt_udp)
+		s = socket(AF_INET, SOCK_DGRAM, 0);
+	else
 #if defined(PF_PACKET)
-	s = socket(PF_PACKET, SOCK_RAW, 0);
+		s = socket(PF_PACKET, SOCK_RAW, 0);
 #else
-	s = socket(AF_INET, SOCK_PACKET, SOCK_PACKET);
+		s = socket(AF_INET, SOCK_PACKET, SOCK_PACKET);
 #endif
 	if (s < 0) {
 		if (errno == EPERM)
@@ -175,140 +545,847 @@ int main(int argc, char *argv[])
 	/* We look up the station address before reporting failure so that
 	   errors may be reported even when run as a normal user.
 	*/
-	if (get_dest_addr(argv[optind], &eaddr) != 0)
+	/* Interfaces are looked up while sending, so one that is recreated
+	   keeps working.  Only the neighbour table needs one with UDP. */
+	if (! opt_udp || (hold && opt_hold_backend == HOLD_NEIGH)) {
+		if (! links_start() || (default_link = links_get(ifname)) == NULL)
+			return 1;
+		if (link_ifindex(default_link) == 0) {
+			fprintf(stderr, "Interface %s doesn't exist\n", ifname);
+			return 1;
+		}
+	}
+	if (opt_hosts && ! hostdb_open(opt_hosts))
+		return 3;
+	if (opt_learn && ! prewake_open(opt_learn, opt_lead))
+		return 3;
+	if (opt_multi) {
+		if (! add_targets(argv + optind, (unsigned int)(argc - optind)))
+			return 3;
+	} else if (get_dest_addr(argv[optind], &eaddr) != 0)
 		return 3;
 	if (perm_failure && ! debug)
 		return 2;
 
-	pktsize = get_fill(outpack, &eaddr);
-
 	/* Fill in the source address, if possible.
 	   The code to retrieve the local station address is Linux specific. */
-	if (! opt_no_src_addr) {
-		struct ifreq if_hwaddr;
-		const char *hwaddr = if_hwaddr.ifr_hwaddr.sa_data;
-
-		strcpy(if_hwaddr.ifr_name, ifname);
-		if (ioctl(s, SIOCGIFHWADDR, &if_hwaddr) < 0) {
-			fprintf(stderr, "SIOCGIFHWADDR on %s failed: %s\n", ifname,
-					strerror(errno));
+	if (! opt_no_src_addr && ! opt_udp) {
+		if (! link_hwaddr(default_link, src_hwaddr)) {
+			fprintf(stderr, "Interface %s has no Ethernet address\n", ifname);
 			/* Magic packets still work if our source address is bogus, but
 			   we fail just to be anal. */
 			return 1;
 		}
-		memcpy(outpack+6, if_hwaddr.ifr_hwaddr.sa_data, 6);
 
 		if (verbose) {
-			printf("The hardware address (SIOCGIFHWADDR) of %s is type %d  "
+			printf("The hardware address of %s is "
 				   "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x.\n", ifname,
-				   if_hwaddr.ifr_hwaddr.sa_family, hwaddr[0], hwaddr[1],
-				   hwaddr[2], hwaddr[3], hwaddr[4], hwaddr[5]);
+				   src_hwaddr[0], src_hwaddr[1], src_hwaddr[2],
+				   src_hwaddr[3], src_hwaddr[4], src_hwaddr[5]);
 		}
 	}
 
-	if (wol_passwd_sz > 0) {
-		memcpy(outpack+pktsize, wol_passwd, wol_passwd_sz);
-		pktsize += wol_passwd_sz;
+	targets_set_cooldown(opt_waking_cooldown, opt_awake_cooldown);
+
+	if (opt_multi) {
+		targets_for_each(build_target_packet);
+		if (verbose)
+			printf("Loaded %zu targets\n", targets_count());
+	} else {
+		single_target.eaddr = eaddr;
+		single_target.udp_dest = udp_dest;
+		single_target.link = default_link;
+		if (opt_learn)
+			single_target.model = prewake_model(&eaddr);
+		build_target_packet(&single_target);
 	}
 
-	if (verbose > 1) {
+	if (verbose > 1 && ! opt_multi) {
 		printf("The final packet is: ");
-		for (i = 0; i < pktsize; i++)
-			printf(" %2.2x", outpack[i]);
+		for (i = 0; i < single_target.packet_size; i++)
+			printf(" %2.2x", single_target.packet[i]);
 		printf(".\n");
 	}
 
-	if (hold) {
-		send_function = &send_magic_packet_wait_online;
-		if (setup_hold(ip_address) == 0) {
-			fprintf(stderr, "Failed setting up defer mechanism");
-			return 1;
-		}
-	}
-
 	/* This is necessary for broadcasts to work */
 	if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, (char *)&one, sizeof(one)) < 0)
 		perror("setsockopt: SO_BROADCAST");
 
 #if defined(PF_PACKET)
-	{
-		struct ifreq ifr;
-		strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
-		if (ioctl(s, SIOCGIFINDEX, &ifr) == -1) {
-			fprintf(stderr, "SIOCGIFINDEX on %s failed: %s\n", ifname,
-					strerror(errno));
-			return 1;
-		}
-		memset(&whereto, 0, sizeof(whereto));
-		whereto.sll_family = AF_PACKET;
-		whereto.sll_ifindex = ifr.ifr_ifindex;
-		/* The manual page incorrectly claims the address must be filled.
-		   We do so because the code may change to match the docs. */
-		whereto.sll_halen = ETH_ALEN;
-		memcpy(whereto.sll_addr, outpack, ETH_ALEN);
+	/* The interface index is filled in for each packet */
+	memset(&whereto, 0, sizeof(whereto));
+	whereto.sll_family = AF_PACKET;
+	/* The manual page incorrectly claims the address must be filled.
+	   We do so because the code may change to match the docs. */
+	whereto.sll_halen = ETH_ALEN;
+	memcpy(whereto.sll_addr, single_target.packet, ETH_ALEN);
 
-	}
+	if (opt_other_ifnames && ! get_other_interfaces(opt_other_ifnames))
+		return 1;
 #else
 	whereto.sa_family = 0;
 	strcpy(whereto.sa_data, ifname);
 #endif
 
+	if (hold) {
+		if (setup_hold(&target_probed, &retry_magic_packet,
+					   opt_hold_backend) == 0 ||
+			(opt_multi && targets_for_each(add_hold_target) != 0) ||
+			(! opt_multi && ! hold_add_target(&single_target, ip_address))) {
+			fprintf(stderr, "Failed setting up defer mechanism");
+			return 1;
+		}
+	}
+
+	if (opt_rules && ! match_load(opt_rules))
+		return 3;
+
+	if (opt_metrics &&
+		! metrics_start_export(opt_metrics, METRICS_INTERVAL, &write_metrics)) {
+		fprintf(stderr, "Failed starting metrics export\n");
+		return 1;
+	}
+
+	if (opt_learn && ! prewake_start(&prewake_targets)) {
+		fprintf(stderr, "Failed starting to wake hosts ahead of time\n");
+		return 1;
+	}
+
+	/* Pick up changes of the hosts file while acting on packets */
+	if (opt_hosts && (opt_nfqueue_num >= 0 || opt_events) &&
+		! hostdb_watch_start(&host_changed)) {
+		fprintf(stderr, "Failed watching %s\n", opt_hosts);
+		return 1;
+	}
+
+	if (opt_counter) {
+		struct acct_config acct_config = { 0, };
+
+		if (verbose || debug)
+			printf("Polling counter %s every %u ms\n", opt_counter,
+				   opt_counter_interval);
+		install_signal_handlers();
+		acct_config.name = opt_counter;
+		acct_config.interval_ms = opt_counter_interval;
+		acct_config.report = &print_report;
+		ret = acct_poll(&acct_config, &counter_moved);
+		prewake_close();
+		metrics_stop_export();
+		if (hold)
+			cleanup_hold();
+		links_stop();
+		return ret;
+	}
+
+	if (opt_events) {
+		struct ct_config ct_config = { 0, };
+
+		if (verbose || debug)
+			printf("Acting on new connections to %zu targets\n",
+				   targets_count());
+		install_signal_handlers();
+		ct_config.port_min = opt_port_min;
+		ct_config.port_max = opt_port_max;
+		ct_config.rcvbuf = nfqueue_config.rcvbuf;
+		ct_config.report = &print_report;
+		ret = ct_receive(&ct_config, &connection_new);
+		prewake_close();
+		hostdb_close();
+		metrics_stop_export();
+		if (hold)
+			cleanup_hold();
+		targets_cleanup();
+		links_stop();
+		return ret;
+	}
+
+	if (opt_nfqueue_num < 0 && opt_multi)
+		return wake_all_targets();
 	if (opt_nfqueue_num < 0)
-		return send_function();
+		return wake_target(&single_target);
 
-	if (verbose || debug)
+	if ((verbose || debug) && opt_nfqueue_count > 1)
+		printf("Acting on packets in NFQUEUEs %d to %d\n", opt_nfqueue_num,
+			   opt_nfqueue_num + opt_nfqueue_count - 1);
+	else if (verbose || debug)
 		printf("Acting on packets in NFQUEUE %d\n", opt_nfqueue_num);
 
-	ret = nfqueue_receive(opt_nfqueue_num, send_function);
+	install_signal_handlers();
+
+	if ((opt_async || opt_park_timeout) && !wake_start(&wake_queued)) {
+		fprintf(stderr, "Failed starting wake thread\n");
+		return 1;
+	}
+
+	nfqueue_config.queue_num = opt_nfqueue_num;
+	nfqueue_config.queue_count = opt_nfqueue_count;
+	nfqueue_config.park_timeout_ms = opt_park_timeout;
+	nfqueue_config.park_drop = opt_park_drop;
+	nfqueue_config.flow_mark = opt_flow_mark;
+	nfqueue_config.flow_mark_mask = opt_flow_mask;
+	nfqueue_config.park_released = &target_online;
+	nfqueue_config.park_ended = &target_unparked;
+	nfqueue_config.report = &print_report;
+	nfqueue_config.async = opt_async;
+	/* The destination address is all we need to select the target */
+	if (opt_multi)
+		nfqueue_config.copy_range = 40;
+	/* The rules look at the transport header as well */
+	if (opt_rules)
+		nfqueue_config.copy_range = MATCH_COPY_RANGE;
+
+	if (opt_control && ! control_start(opt_control, &handle_control))
+		return 1;
 
+	ret = nfqueue_receive(&nfqueue_config, &handle_packet);
+
+	control_stop();
+	prewake_close();
+	hostdb_close();
+	metrics_stop_export();
+	if (opt_async || opt_park_timeout)
+		wake_stop();
 	if (hold)
 		cleanup_hold();
+	if (opt_multi)
+		targets_cleanup();
+	links_stop();
+	match_cleanup();
 	return ret;
 }
 
-static int send_magic_packet()
+/* Send the packets of all TARGETS, each opt_burst times, with as few
+   syscalls as possible */
+static int send_magic_packets(struct target **targets, unsigned int count)
 {
-	int i;
+	struct mmsghdr msgs[SEND_BATCH];
+	/* Destination, source address and the rest of each packet */
+	struct iovec iovecs[SEND_BATCH][3];
+	u_char srcs[SEND_BATCH][ETH_ALEN];
+#if defined(PF_PACKET)
+	struct sockaddr_ll dests[SEND_BATCH];
+#endif
+	struct timespec start, end;
+	unsigned int total = count * opt_burst;
+	unsigned int sent = 0, n, i;
+	uint64_t elapsed_ns;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	if ((i = sendto(s, outpack, pktsize, 0, (struct sockaddr *)&whereto,
-					sizeof(whereto))) < 0)
-		perror("sendto");
-	else if (debug)
-		printf("Sendto worked ! %d.\n", i);
+	while (sent < total) {
+		/* Copies of a packet go out back to back */
+		n = total - sent < SEND_BATCH ? total - sent : SEND_BATCH;
+		memset(msgs, 0, n * sizeof(*msgs));
+		for (i = 0; i < n; i++) {
+			struct target *target = targets[(sent + i) / opt_burst];
+
+			msgs[i].msg_hdr.msg_iov = iovecs[i];
+			if (opt_udp) {
+				iovecs[i][0].iov_base = target->packet + UDP_PAYLOAD_OFFSET;
+				iovecs[i][0].iov_len = target->packet_size - UDP_PAYLOAD_OFFSET;
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_name = &target->udp_dest;
+				msgs[i].msg_hdr.msg_namelen = sizeof(target->udp_dest);
+			} else {
+				/* From the current address of the interface, which may
+				   have been recreated with another one */
+				if (i > 0 && (sent + i) % opt_burst != 0)
+					memcpy(srcs[i], srcs[i - 1], ETH_ALEN);
+				else if (opt_no_src_addr ||
+						 ! link_hwaddr(target->link, srcs[i]))
+					memcpy(srcs[i], target->packet + ETH_ALEN, ETH_ALEN);
+				iovecs[i][0].iov_base = target->packet;
+				iovecs[i][0].iov_len = ETH_ALEN;
+				iovecs[i][1].iov_base = srcs[i];
+				iovecs[i][1].iov_len = ETH_ALEN;
+				iovecs[i][2].iov_base = target->packet + 2 * ETH_ALEN;
+				iovecs[i][2].iov_len = target->packet_size - 2 * ETH_ALEN;
+				msgs[i].msg_hdr.msg_iovlen = 3;
+#if defined(PF_PACKET)
+				/* Fails with ENXIO while the interface doesn't exist */
+				dests[i] = whereto;
+				dests[i].sll_ifindex = link_ifindex(target->link);
+				msgs[i].msg_hdr.msg_name = &dests[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(dests[i]);
+#else
+				msgs[i].msg_hdr.msg_name = &whereto;
+				msgs[i].msg_hdr.msg_namelen = sizeof(whereto);
+#endif
+			}
+		}
+
+		ret = sendmmsg(s, msgs, n, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("sendmmsg");
+			__atomic_add_fetch(&send_stats.errors, 1, __ATOMIC_RELAXED);
+			/* Give the remaining targets a chance */
+			ret = 1;
+		}
+		sent += ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000ull +
+		end.tv_nsec - start.tv_nsec;
+
+	metrics_record(METRIC_SEND, elapsed_ns);
+	__atomic_add_fetch(&send_stats.batches, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&send_stats.frames, total, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&send_stats.total_ns, elapsed_ns, __ATOMIC_RELAXED);
+	if (elapsed_ns > __atomic_load_n(&send_stats.max_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&send_stats.max_ns, elapsed_ns, __ATOMIC_RELAXED);
+
+	if (debug)
+		printf("Sent %u packets to %u targets in %.1f us\n", total, count,
+			   elapsed_ns / 1000.0);
 
 #ifdef USE_SEND
-	if (bind(s, (struct sockaddr *)&whereto, sizeof(whereto)) < 0)
-		perror("bind");
-	else if (send(s, outpack, 100, 0) < 0)
-		perror("send");
+	for (i = 0; i < count; i++) {
+		if (bind(s, (struct sockaddr *)&whereto, sizeof(whereto)) < 0)
+			perror("bind");
+		else if (send(s, targets[i]->packet, 100, 0) < 0)
+			perror("send");
+	}
 #endif
 #ifdef USE_SENDMSG
-	{
+	for (i = 0; i < count; i++) {
 		struct msghdr msghdr = { 0,};
 		struct iovec iovector[1];
 		msghdr.msg_name = &whereto;
 		msghdr.msg_namelen = sizeof(whereto);
 		msghdr.msg_iov = iovector;
 		msghdr.msg_iovlen = 1;
-		iovector[0].iov_base = outpack;
-		iovector[0].iov_len = pktsize;
-		if ((i = sendmsg(s, &msghdr, 0)) < 0)
+		iovector[0].iov_base = targets[i]->packet;
+		iovector[0].iov_len = targets[i]->packet_size;
+		if ((ret = sendmsg(s, &msghdr, 0)) < 0)
 			perror("sendmsg");
 		else if (debug)
-			printf("sendmsg worked, %d (%d).\n", i, errno);
+			printf("sendmsg worked, %d (%d).\n", ret, errno);
+	}
+#endif
+
+	return 0;
+}
+
+/* Send one magic packet opt_burst times */
+static void send_copies(const void *packet, size_t len, const void *dest,
+						socklen_t dest_len)
+{
+	unsigned int i;
+
+	for (i = 0; i < opt_burst; i++) {
+		if (sendto(s, packet, len, 0, dest, dest_len) < 0) {
+			perror("sendto");
+			__atomic_add_fetch(&send_stats.errors, 1, __ATOMIC_RELAXED);
+			return;
+		}
 	}
+	__atomic_add_fetch(&send_stats.frames, opt_burst, __ATOMIC_RELAXED);
+}
+
+/* Called from hold.c while a host doesn't respond.  Later attempts are
+   broadcast, in case the host's switch forgot its address, and then on
+   other interfaces, in case it moved. */
+static void retry_magic_packet(struct target *target, unsigned int attempt)
+{
+	u_char packet[TARGET_PACKET_SIZE];
+#if defined(PF_PACKET)
+	struct sockaddr_ll dest = whereto;
+	int i;
 #endif
 
+	__atomic_add_fetch(&send_stats.retries, 1, __ATOMIC_RELAXED);
+	/* A broadcast of our own would miss a host in another subnet */
+	if (attempt < RETRY_BROADCAST || opt_udp) {
+		send_magic_packets(&target, 1);
+		return;
+	}
+
+	memcpy(packet, target->packet, target->packet_size);
+	memset(packet, 0xff, ETH_ALEN);
+	if (! opt_no_src_addr)
+		link_hwaddr(target->link, packet + ETH_ALEN);
+#if defined(PF_PACKET)
+	dest.sll_ifindex = link_ifindex(target->link);
+	send_copies(packet, target->packet_size, &dest, sizeof(dest));
+	for (i = 0; attempt >= RETRY_OTHER_INTERFACES && i < other_count; i++) {
+		dest.sll_ifindex = link_ifindex(other_links[i]);
+		/* Other interfaces may come and go, e.g. VLANs */
+		if (other_links[i] == target->link || dest.sll_ifindex == 0)
+			continue;
+		send_copies(packet, target->packet_size, &dest, sizeof(dest));
+	}
+#else
+	send_copies(packet, target->packet_size, &whereto, sizeof(whereto));
+#endif
+}
+
+/* Packets parked for a target that was replaced since wait for the new
+   one */
+static int target_online(void *key)
+{
+	return target_is_awake(target_current(key));
+}
+
+/* Drops the reference of a parked packet once it got its verdict */
+static void target_unparked(void *key)
+{
+	target_put(key);
+}
+
+/* Called from the ping or neighbour thread once a parked target's
+   probing ended */
+static void target_probed(struct target *target, int online)
+{
+	target_woken(target_current(target), online);
+	target_probe_ended(target);
+	/* Let parked packets pass or wait for their deadline */
+	nfqueue_notify();
+}
+
+/* Start probing a woken target, unless it is probed already */
+static void probe_target(struct target *target)
+{
+	int online;
+
+	if (__atomic_exchange_n(&target->probing, 1, __ATOMIC_ACQ_REL))
+		return;
+	/* Dropped by target_probe_ended() */
+	target_get(target);
+
+	/* Parked packets don't need this thread to wait for the host */
+	if (opt_park_timeout) {
+		if (! hold_start(target))
+			target_probed(target, 0);
+		return;
+	}
+
+	online = hold_for_online(target);
+	target_woken(target_current(target), online);
+	target_probe_ended(target);
+}
+
+/* Runs in the wake thread in async and parking mode, with all targets
+   queued meanwhile */
+static int wake_targets(void **args, unsigned int count)
+{
+	struct target **targets = (struct target **)args;
+	unsigned int i;
+
+	send_magic_packets(targets, count);
+
+	if (hold)
+		for (i = 0; i < count; i++)
+			probe_target(targets[i]);
+	return 0;
+}
+
+/* Runs in the wake thread, drops the references of queued targets */
+static int wake_queued(void **args, unsigned int count)
+{
+	unsigned int i;
+
+	wake_targets(args, count);
+	for (i = 0; i < count; i++)
+		target_put(args[i]);
 	return 0;
 }
 
-static int send_magic_packet_wait_online()
+static int wake_target(struct target *target)
+{
+	return wake_targets((void **)&target, 1);
+}
+
+/* Hand TARGET to the wake thread, it is asleep again if that fails */
+static void queue_wake(struct target *target)
+{
+	if (! wake_enqueue(target_get(target))) {
+		target_woken(target, 0);
+		target_put(target);
+	}
+}
+
+static int add_hold_target(struct target *target)
+{
+	return ! hold_add_target(target, NULL);
+}
+
+static int handle_target_packet(struct nfqueue_packet *packet,
+								struct target *target)
+{
+	/* Falling behind, don't spend time on rules and counters for hosts
+	   that are up anyway */
+	if (packet->overloaded && target_is_awake(target)) {
+		packet->mark_flow = opt_mark_awake;
+		return NFQUEUE_ACCEPT;
+	}
+
+	if (opt_rules &&
+		match_packet(packet->payload, packet->len) == MATCH_IGNORE) {
+		if (debug)
+			puts("Packet ignored by the rules");
+		return NFQUEUE_ACCEPT;
+	}
+
+	prewake_record(target->model);
+	switch (target_trigger(target)) {
+	case TRIGGER_WAKE:
+		if (! opt_async && ! opt_park_timeout)
+			wake_target(target);
+		else
+			queue_wake(target);
+		break;
+	case TRIGGER_AWAKE:
+		packet->mark_flow = opt_mark_awake;
+		return NFQUEUE_ACCEPT;
+	}
+
+	/* The connection has done its part, later packets of it only add
+	   to the cool-down */
+	packet->mark_flow = opt_flow_mask != 0;
+	if (opt_park_timeout) {
+		/* Dropped by target_unparked() */
+		packet->park_key = target_get(target);
+		return NFQUEUE_PARK;
+	}
+	return NFQUEUE_ACCEPT;
+}
+
+static int handle_packet(struct nfqueue_packet *packet)
 {
-	send_magic_packet();
-	hold_for_online();
+	struct target *target;
+	int ret;
+
+	if (! opt_multi)
+		return handle_target_packet(packet, &single_target);
+
+	target = targets_lookup_packet(packet->payload, packet->len);
+	if (target == NULL) {
+		if (debug)
+			puts("No target for the packet's destination address");
+		return NFQUEUE_ACCEPT;
+	}
+	ret = handle_target_packet(packet, target);
+	target_put(target);
+	return ret;
+}
+
+/* Called from acct_poll() when packets for the target were counted */
+static void counter_moved(uint64_t packets)
+{
+	if (debug)
+		printf("Counter moved by %llu packets\n",
+			   (unsigned long long)packets);
+	prewake_record(single_target.model);
+	if (target_trigger(&single_target) == TRIGGER_WAKE)
+		wake_target(&single_target);
+}
+
+/* Called from ct_receive() for new connections to a target */
+static void connection_new(struct target *target)
+{
+	prewake_record(target->model);
+	if (target_trigger(target) == TRIGGER_WAKE)
+		wake_target(target);
+}
+
+/* Wake a target that is usually used soon, unless it is up already */
+static int prewake_target(struct target *target)
+{
+	char mac[18];
+
+	if (target->model == NULL || ! prewake_due(target->model) ||
+		target_trigger(target) != TRIGGER_WAKE)
+		return 0;
+
+	if (verbose || debug)
+		printf("Waking %s ahead of its usual use\n",
+			   ether_ntoa_r(&target->eaddr, mac));
+	__atomic_add_fetch(&prewakes, 1, __ATOMIC_RELAXED);
+	/* Probing is left to the wake thread, this one must not block */
+	if (opt_async || opt_park_timeout)
+		queue_wake(target);
+	else
+		send_magic_packets(&target, 1);
 	return 0;
 }
 
+/* Called from the prewake thread every minute */
+static void prewake_targets()
+{
+	if (opt_multi)
+		targets_for_each(prewake_target);
+	else
+		prewake_target(&single_target);
+}
+
+static struct target **all_targets;
+static unsigned int all_count;
+
+static int collect_target(struct target *target)
+{
+	all_targets[all_count++] = target_get(target);
+	return 0;
+}
+
+static void put_targets()
+{
+	unsigned int i;
+
+	for (i = 0; i < all_count; i++)
+		target_put(all_targets[i]);
+	free(all_targets);
+	all_targets = NULL;
+}
+
+/* Wake all targets given with '-m' at once, e.g. after a power outage */
+static int wake_all_targets()
+{
+	all_count = 0;
+	all_targets = calloc(targets_count(), sizeof(*all_targets));
+	if (all_targets == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	targets_for_each(collect_target);
+	wake_targets((void **)all_targets, all_count);
+
+	put_targets();
+	targets_cleanup();
+	return 0;
+}
+
+static void print_report(FILE *stream)
+{
+	unsigned long batches =
+		__atomic_load_n(&send_stats.batches, __ATOMIC_RELAXED);
+
+	if (batches)
+		fprintf(stream, "%lu send batches, %lu packets, %lu errors, "
+				"%.1f us per batch, at most %.1f us\n", batches,
+				__atomic_load_n(&send_stats.frames, __ATOMIC_RELAXED),
+				__atomic_load_n(&send_stats.errors, __ATOMIC_RELAXED),
+				__atomic_load_n(&send_stats.total_ns, __ATOMIC_RELAXED) /
+				1000.0 / batches,
+				__atomic_load_n(&send_stats.max_ns, __ATOMIC_RELAXED) / 1000.0);
+
+	if (opt_learn)
+		fprintf(stream, "%lu wakes ahead of usual use\n",
+				__atomic_load_n(&prewakes, __ATOMIC_RELAXED));
+	if (opt_multi)
+		targets_print_stats(stream);
+	else
+		target_print_stats(stream, &single_target);
+	if (hold)
+		hold_print_stats(stream);
+	if (hold && opt_hold_backend == HOLD_PING)
+		ping_print_stats(stream);
+	if (opt_rules)
+		match_print_stats(stream);
+	metrics_print(stream);
+}
+
+/* Called from the metrics export thread */
+static void write_metrics(FILE *stream)
+{
+	struct nfqueue_stats stats;
+	struct target_totals totals = { 0, };
+
+	metrics_write_histograms(stream);
+
+	if (opt_nfqueue_num >= 0) {
+		nfqueue_get_stats(&stats);
+		metrics_write_counter(stream, "packets_total",
+				"Packets received from the queue", stats.packets);
+		metrics_write_counter(stream, "verdicts_total",
+				"Verdicts sent", stats.verdicts);
+		metrics_write_counter(stream, "verdict_errors_total",
+				"Verdict messages the kernel rejected",
+				stats.verdict_errors);
+		metrics_write_counter(stream, "parked_total",
+				"Packets held until their target was online", stats.parked);
+		metrics_write_counter(stream, "expired_total",
+				"Held packets whose target did not come online",
+				stats.expired);
+		metrics_write_counter(stream, "marked_total",
+				"Connections marked to bypass the queue", stats.marked);
+		metrics_write_counter(stream, "socket_overruns_total",
+				"Netlink socket overruns reported with ENOBUFS",
+				stats.enobufs);
+		metrics_write_counter(stream, "shed_total",
+				"Packets received while shedding load", stats.shed);
+		metrics_write_counter(stream, "kernel_dropped_total",
+				"Packets the kernel dropped instead of queueing",
+				stats.kernel_dropped);
+		metrics_write_counter(stream, "bypassed_total",
+				"Packets that passed the queue unseen", stats.bypassed);
+		metrics_write_gauge(stream, "queue_backlog",
+				"Packets waiting for a verdict", stats.backlog);
+	}
+
+	if (opt_multi)
+		targets_get_totals(&totals);
+	else
+		target_add_totals(&single_target, &totals);
+	metrics_write_counter(stream, "triggers_total",
+			"Packets, counts or connections for a target", totals.triggers);
+	metrics_write_counter(stream, "magic_packets_total",
+			"Wake-ups sent", totals.wakes);
+	metrics_write_counter(stream, "suppressed_total",
+			"Triggers within a cool-down", totals.suppressed);
+	metrics_write_counter(stream, "wake_retries_total",
+			"Magic packets resent to hosts that did not respond",
+			__atomic_load_n(&send_stats.retries, __ATOMIC_RELAXED));
+	metrics_write_counter(stream, "prewakes_total",
+			"Wake-ups sent ahead of usual use",
+			__atomic_load_n(&prewakes, __ATOMIC_RELAXED));
+	metrics_write_counter(stream, "send_errors_total",
+			"Magic packets that could not be sent",
+			__atomic_load_n(&send_stats.errors, __ATOMIC_RELAXED));
+}
+
+/* Add a target while running or replace the one with the same address,
+   frees TARGET on failure */
+static int publish_target(struct target *target)
+{
+	build_target_packet(target);
+	if ((hold && ! hold_add_target(target, NULL)) ||
+		! targets_replace(target)) {
+		free(target);
+		return 0;
+	}
+	return 1;
+}
+
+static int control_add(const char *arg, FILE *reply)
+{
+	struct target *target = new_target(arg);
+
+	if (target == NULL) {
+		fprintf(reply, "Invalid target %s\n", arg);
+		return 0;
+	}
+	if (! publish_target(target)) {
+		fprintf(reply, "Failed adding target %s\n", arg);
+		return 0;
+	}
+	return 1;
+}
+
+static int control_remove(const char *arg, FILE *reply)
+{
+	unsigned char addr[16];
+	int family = strchr(arg, ':') != NULL ? AF_INET6 : AF_INET;
+
+	if (inet_pton(family, arg, addr) != 1) {
+		fprintf(reply, "Invalid IP address %s\n", arg);
+		return 0;
+	}
+	if (! targets_remove(family, addr)) {
+		fprintf(reply, "No target with address %s\n", arg);
+		return 0;
+	}
+	return 1;
+}
+
+/* Targets are never changed once published, so each one is replaced by
+   a copy with the new magic packet */
+static int control_password(const char *arg, FILE *reply)
+{
+	unsigned int i;
+	int ret = 1;
+
+	if (strcmp(arg, "none") == 0)
+		wol_passwd_sz = 0;
+	else if (! get_wol_pw(arg)) {
+		fprintf(reply, "Invalid password %s\n", arg);
+		return 0;
+	}
+
+	all_count = 0;
+	all_targets = calloc(targets_count(), sizeof(*all_targets));
+	if (all_targets == NULL) {
+		fprintf(reply, "Out of memory\n");
+		return 0;
+	}
+	targets_for_each(collect_target);
+
+	for (i = 0; i < all_count && ret; i++) {
+		struct target *old = all_targets[i], *target;
+
+		target = target_clone(old);
+		if (target == NULL) {
+			ret = 0;
+			break;
+		}
+		build_target_packet(target);
+		if (! targets_replace(target)) {
+			free(target);
+			ret = 0;
+		}
+	}
+	if (! ret)
+		fprintf(reply, "Failed updating targets\n");
+
+	put_targets();
+	return ret;
+}
+
+static int run_control(char *command, FILE *reply)
+{
+	char *arg = strchr(command, ' ');
+
+	if (arg != NULL) {
+		*arg++ = '\0';
+		arg += strspn(arg, " ");
+	}
+
+	if (strcmp(command, "list") == 0) {
+		targets_print(reply);
+		return 1;
+	}
+	if (strcmp(command, "stats") == 0) {
+		print_report(reply);
+		return 1;
+	}
+	if (arg == NULL || *arg == '\0') {
+		fprintf(reply, "Unknown command %s\n", command);
+		return 0;
+	}
+
+	if (strcmp(command, "add") == 0)
+		return control_add(arg, reply);
+	if (strcmp(command, "remove") == 0)
+		return control_remove(arg, reply);
+	if (strcmp(command, "password") == 0)
+		return control_password(arg, reply);
+	if (strcmp(command, "cooldown") == 0) {
+		if (get_cooldown(arg) < 0) {
+			fprintf(reply, "Invalid cool-down %s\n", arg);
+			return 0;
+		}
+		targets_set_cooldown(opt_waking_cooldown, opt_awake_cooldown);
+		return 1;
+	}
+
+	fprintf(reply, "Unknown command %s\n", command);
+	return 0;
+}
+
+/* Called from the control thread for each command */
+static int handle_control(char *command, FILE *reply)
+{
+	int ret;
+
+	pthread_mutex_lock(&update_lock);
+	ret = run_control(command, reply);
+	pthread_mutex_unlock(&update_lock);
+	return ret;
+}
+
 /* Convert the host ID string to a MAC address.
    The string may be a
 	Host name
@@ -319,6 +1396,7 @@ static int send_magic_packet_wait_online()
 static int get_dest_addr(const char *hostid, struct ether_addr *eaddr)
 {
 	struct ether_addr *eap;
+	struct hostdb_entry entry;
 
 	eap = ether_aton(hostid);
 	if (eap) {
@@ -326,6 +1404,11 @@ static int get_dest_addr(const char *hostid, struct ether_addr *eaddr)
 		if (debug)
 			fprintf(stderr, "The target station address is %s.\n",
 					ether_ntoa(eaddr));
+	} else if (opt_hosts && hostdb_lookup(hostid, &entry)) {
+		*eaddr = entry.eaddr;
+		if (debug)
+			fprintf(stderr, "Station address for host %s in %s is %s.\n",
+					hostid, opt_hosts, ether_ntoa(eaddr));
 	} else if (ether_hostton(hostid, eaddr) == 0) {
 		if (debug)
 			fprintf(stderr, "Station address for hostname %s is %s.\n",
@@ -341,6 +1424,213 @@ static int get_dest_addr(const char *hostid, struct ether_addr *eaddr)
 	return 0;
 }
 
+/* Parse a target given as <host-id>=<ip-address>[@<ifname>], it isn't
+   added to the table yet */
+static struct target *new_target(const char *arg)
+{
+	char hostid[256], ip[INET6_ADDRSTRLEN + 4], target_ifname[LINK_NAME_SIZE];
+	const char *ip_start = strchr(arg, '=');
+	const char *ip_end;
+	char *prefix_start;
+	unsigned char addr[16];
+	struct ether_addr eaddr;
+	unsigned long prefix = 0;
+	int family = AF_INET;
+
+	if (ip_start == NULL || ip_start == arg ||
+		(size_t)(ip_start - arg) >= sizeof(hostid)) {
+		fprintf(stderr, "Specify the target %s as <host-id>=<ip-address>.\n",
+				arg);
+		return NULL;
+	}
+	memcpy(hostid, arg, ip_start - arg);
+	hostid[ip_start - arg] = '\0';
+	ip_start++;
+
+	/* The host may be on another interface than the one of '-i' */
+	target_ifname[0] = '\0';
+	ip_end = strchr(ip_start, '@');
+	if (ip_end == NULL)
+		ip_end = ip_start + strlen(ip_start);
+	else if (ip_end[1] == '\0' || strlen(ip_end + 1) >= sizeof(target_ifname)) {
+		fprintf(stderr, "Invalid interface for target %s.\n", hostid);
+		return NULL;
+	} else
+		strcpy(target_ifname, ip_end + 1);
+	if ((size_t)(ip_end - ip_start) >= sizeof(ip)) {
+		fprintf(stderr, "Invalid IP address for target %s.\n", hostid);
+		return NULL;
+	}
+	memcpy(ip, ip_start, ip_end - ip_start);
+	ip[ip_end - ip_start] = '\0';
+
+	/* With UDP, a prefix length selects the subnet's broadcast address */
+	prefix_start = strchr(ip, '/');
+	if (prefix_start != NULL &&
+		(! opt_udp || get_ulong(prefix_start + 1, 32, &prefix) < 0)) {
+		fprintf(stderr, "Invalid prefix length for target %s, it is only "
+				"used with '-U'.\n", hostid);
+		return NULL;
+	}
+	if (prefix_start != NULL)
+		*prefix_start = '\0';
+
+	if (strchr(ip, ':') != NULL)
+		family = AF_INET6;
+	if (inet_pton(family, ip, addr) != 1) {
+		fprintf(stderr, "Invalid IP address %s for target %s.\n", ip, hostid);
+		return NULL;
+	}
+	if (get_dest_addr(hostid, &eaddr) != 0)
+		return NULL;
+	return create_target(hostid, family, addr, &eaddr,
+						 prefix_start != NULL ? (int)prefix : -1, target_ifname);
+}
+
+/* A target at ADDR, PREFIX is the length of its subnet or -1.  It is on
+   the interface TARGET_IFNAME, or the one of '-i' when empty. */
+static struct target *create_target(const char *hostid, int family,
+									const unsigned char *addr,
+									const struct ether_addr *eaddr, int prefix,
+									const char *target_ifname)
+{
+	struct target *target;
+
+	if ((target = target_new(family, addr, eaddr)) == NULL)
+		return NULL;
+	if (opt_learn)
+		target->model = prewake_model(eaddr);
+
+	/* With UDP, the route to the address decides */
+	if (default_link != NULL && *target_ifname != '\0') {
+		target->link = links_get(target_ifname);
+		if (target->link == NULL) {
+			free(target);
+			return NULL;
+		}
+		if (link_ifindex(target->link) == 0)
+			fprintf(stderr, "Interface %s of target %s doesn't exist (yet)\n",
+					target_ifname, hostid);
+	} else
+		target->link = default_link;
+
+	if (! opt_udp)
+		return target;
+	target->udp_dest = udp_dest;
+	if (family != AF_INET) {
+		/* Only the address given with '-U' can be used */
+		if (udp_dest.sin_addr.s_addr != INADDR_ANY)
+			return target;
+		fprintf(stderr, "Magic packets for IPv6 target %s need an address "
+				"with '-U'.\n", hostid);
+		free(target);
+		return NULL;
+	}
+	if (prefix >= 0) {
+		uint32_t mask = prefix ? ~0u << (32 - prefix) : 0;
+
+		memcpy(&target->udp_dest.sin_addr, addr, 4);
+		target->udp_dest.sin_addr.s_addr |= htonl(~mask);
+	} else if (udp_dest.sin_addr.s_addr == INADDR_ANY)
+		memcpy(&target->udp_dest.sin_addr, addr, 4);
+	return target;
+}
+
+/* Hosts without an IP address aren't targets */
+static int host_is_target(const struct hostdb_entry *entry)
+{
+	return entry != NULL && entry->family != 0;
+}
+
+static struct target *host_target(const struct hostdb_entry *entry)
+{
+	struct target *target = create_target(entry->name, entry->family,
+										  entry->addr, &entry->eaddr, -1,
+										  entry->ifname);
+
+	if (target != NULL) {
+		memcpy(target->passwd, entry->passwd, sizeof(target->passwd));
+		target->passwd_size = entry->passwd_size;
+	}
+	return target;
+}
+
+static int collect_host(const struct hostdb_entry *entry)
+{
+	if (! host_is_target(entry))
+		return 0;
+	all_targets[all_count] = host_target(entry);
+	return all_targets[all_count++] == NULL;
+}
+
+/* Add the COUNT targets in ARGS, or all hosts in the database without any.
+   They are added at once, so startup with thousands of them is quick. */
+static int add_targets(char **args, unsigned int count)
+{
+	unsigned int i;
+	int ret = 0;
+
+	hosts_targets = count == 0;
+	all_count = 0;
+	all_targets = calloc((hosts_targets ? hostdb_count() : count) + 1,
+						 sizeof(*all_targets));
+	if (all_targets == NULL) {
+		perror("calloc");
+		return 0;
+	}
+
+	if (hosts_targets)
+		ret = hostdb_for_each(collect_host);
+	for (i = 0; i < count && ret == 0; i++) {
+		all_targets[all_count] = new_target(args[i]);
+		ret = all_targets[all_count++] == NULL;
+	}
+
+	if (ret == 0 && ! targets_add_many(all_targets, all_count))
+		ret = 1;
+	if (ret)
+		for (i = 0; i < all_count; i++)
+			free(all_targets[i]);
+	free(all_targets);
+	all_targets = NULL;
+	return ret == 0;
+}
+
+/* Called from the hosts thread for each host that changed in the file */
+static void host_changed(const struct hostdb_entry *old,
+						 const struct hostdb_entry *entry)
+{
+	struct target *target;
+
+	if (! hosts_targets)
+		return;
+
+	pthread_mutex_lock(&update_lock);
+	if (host_is_target(old) && (! host_is_target(entry) ||
+		entry->family != old->family ||
+		memcmp(entry->addr, old->addr, sizeof(old->addr)) != 0)) {
+		target = targets_lookup(old->family, old->addr);
+		/* Another host may have taken over the address already */
+		if (target != NULL &&
+			memcmp(&target->eaddr, &old->eaddr, sizeof(old->eaddr)) == 0)
+			targets_remove(old->family, old->addr);
+		if (target != NULL)
+			target_put(target);
+	}
+	if (host_is_target(entry)) {
+		target = host_target(entry);
+		if (target == NULL || ! publish_target(target))
+			fprintf(stderr, "Failed updating host %s\n", entry->name);
+	}
+	/* The kernel would keep dropping events for new addresses */
+	if (opt_events)
+		ct_targets_changed();
+	pthread_mutex_unlock(&update_lock);
+
+	if (verbose)
+		printf("Host %s %s\n", old ? old->name : entry->name,
+			   ! entry ? "removed" : old ? "changed" : "added");
+}
 
 static int get_fill(unsigned char *pkt, struct ether_addr *eaddr)
 {
@@ -372,6 +1662,38 @@ static int get_fill(unsigned char *pkt, struct ether_addr *eaddr)
 	return offset;
 }
 
+/* Build the complete magic packet including source address and password */
+static int build_packet(unsigned char *pkt, struct ether_addr *eaddr,
+						const u_char *passwd, int passwd_sz)
+{
+	int size = get_fill(pkt, eaddr);
+
+	if (! opt_no_src_addr)
+		memcpy(pkt+6, src_hwaddr, 6);
+
+	if (passwd_sz > 0) {
+		memcpy(pkt+size, passwd, passwd_sz);
+		size += passwd_sz;
+	}
+	return size;
+}
+
+static int build_target_packet(struct target *target)
+{
+	/* A password from the hosts file wins over the one given with '-p' */
+	if (target->passwd_size > 0)
+		target->packet_size = build_packet(target->packet, &target->eaddr,
+										   target->passwd, target->passwd_size);
+	else
+		target->packet_size = build_packet(target->packet, &target->eaddr,
+										   wol_passwd, wol_passwd_sz);
+	/* Sent from the address of the target's interface, the one of '-i'
+	   while that isn't known.  Refreshed when sending. */
+	if (! opt_no_src_addr && ! opt_udp)
+		link_hwaddr(target->link, target->packet + 6);
+	return 0;
+}
+
 static int get_wol_pw(const char *optarg)
 {
 	int passwd[6];
@@ -395,17 +1717,198 @@ static int get_wol_pw(const char *optarg)
 	return wol_passwd_sz = byte_cnt;
 }
 
+/* Accepts a comma separated list of interfaces, other than the one of '-i' */
+static int get_other_interfaces(char *ifnames)
+{
+	char *name, *saveptr;
+
+	for (name = strtok_r(ifnames, ",", &saveptr); name != NULL;
+		 name = strtok_r(NULL, ",", &saveptr)) {
+		if (other_count == MAX_OTHER_INTERFACES) {
+			fprintf(stderr, "At most %d interfaces can be given with '-B'\n",
+					MAX_OTHER_INTERFACES);
+			return 0;
+		}
+		if ((other_links[other_count] = links_get(name)) == NULL)
+			return 0;
+		if (link_ifindex(other_links[other_count]) == 0)
+			fprintf(stderr, "Interface %s doesn't exist (yet)\n", name);
+		other_count++;
+	}
+	return 1;
+}
+
+/* Accepts a single queue number or a range like 0:3, returns -2 for
+   a range of too many queues */
 static int get_nfqueue_num(const char *optarg)
 {
 	char *endptr;
-	unsigned long val;
+	unsigned long val, last;
 
 	errno = 0;
 	val = strtoul(optarg, &endptr, 10);
 
-	if (errno != 0 || val > UINT16_MAX || endptr == optarg || *endptr != '\0') {
+	if (errno != 0 || val > UINT16_MAX || endptr == optarg) {
 		return -1;
 	}
 
+	last = val;
+	if (*endptr == ':') {
+		const char *range_end = endptr + 1;
+
+		last = strtoul(range_end, &endptr, 10);
+		if (errno != 0 || last > UINT16_MAX || last < val ||
+			endptr == range_end)
+			return -1;
+	}
+	if (*endptr != '\0')
+		return -1;
+	if (last - val >= NFQUEUE_MAX_QUEUES) {
+		fprintf(stderr, "At most %d queues can be used\n",
+				NFQUEUE_MAX_QUEUES);
+		return -2;
+	}
+
+	opt_nfqueue_count = last - val + 1;
 	return opt_nfqueue_num = (int)val;
 }
+
+/* Accepts a single port or a range like 80:443 */
+static int get_port_range(const char *optarg)
+{
+	char *endptr;
+	unsigned long first, last;
+
+	errno = 0;
+	first = strtoul(optarg, &endptr, 10);
+	if (errno != 0 || first == 0 || first > UINT16_MAX || endptr == optarg)
+		return -1;
+
+	last = first;
+	if (*endptr == ':') {
+		const char *range_end = endptr + 1;
+
+		last = strtoul(range_end, &endptr, 10);
+		if (errno != 0 || last > UINT16_MAX || last < first ||
+			endptr == range_end)
+			return -1;
+	}
+	if (*endptr != '\0')
+		return -1;
+
+	opt_port_min = first;
+	opt_port_max = last;
+	return 0;
+}
+
+/* Accepts an IPv4 address, a port or both, as in 192.168.1.255:9 */
+static int get_udp_dest(const char *optarg)
+{
+	char addr[INET_ADDRSTRLEN];
+	const char *colon = strchr(optarg, ':');
+	size_t len = colon ? (size_t)(colon - optarg) : strlen(optarg);
+	unsigned long port = 9;
+
+	if (len >= sizeof(addr))
+		return -1;
+	memcpy(addr, optarg, len);
+	addr[len] = '\0';
+
+	memset(&udp_dest, 0, sizeof(udp_dest));
+	udp_dest.sin_family = AF_INET;
+	if (len > 0 && inet_pton(AF_INET, addr, &udp_dest.sin_addr) != 1)
+		return -1;
+	if (colon != NULL &&
+		(get_ulong(colon + 1, UINT16_MAX, &port) < 0 || port == 0))
+		return -1;
+	udp_dest.sin_port = htons(port);
+
+	opt_udp++;
+	return 0;
+}
+
+/* Accepts the waking cool-down, optionally followed by the awake one */
+static int get_cooldown(const char *optarg)
+{
+	char *endptr;
+	unsigned long waking, awake = opt_awake_cooldown;
+
+	errno = 0;
+	waking = strtoul(optarg, &endptr, 10);
+	if (errno != 0 || waking > UINT32_MAX || endptr == optarg)
+		return -1;
+
+	if (*endptr == ':') {
+		const char *awake_start = endptr + 1;
+
+		awake = strtoul(awake_start, &endptr, 10);
+		if (errno != 0 || awake > UINT32_MAX || endptr == awake_start)
+			return -1;
+	}
+	if (*endptr != '\0')
+		return -1;
+
+	opt_waking_cooldown = waking;
+	opt_awake_cooldown = awake;
+	return 0;
+}
+
+/* Accepts a mark, optionally followed by a mask, as in 0x10/0x10 */
+static int get_flow_mark(const char *optarg)
+{
+	char *endptr;
+	unsigned long mark, mask = UINT32_MAX;
+
+	errno = 0;
+	mark = strtoul(optarg, &endptr, 0);
+	if (errno != 0 || mark > UINT32_MAX || endptr == optarg)
+		return -1;
+
+	if (*endptr == '/') {
+		const char *mask_start = endptr + 1;
+
+		mask = strtoul(mask_start, &endptr, 0);
+		if (errno != 0 || mask > UINT32_MAX || endptr == mask_start)
+			return -1;
+	}
+	if (*endptr != '\0' || mark == 0 || mark & ~mask)
+		return -1;
+
+	opt_flow_mark = mark;
+	opt_flow_mask = mask;
+	return 0;
+}
+
+static int get_ulong(const char *optarg, unsigned long max,
+					 unsigned long *val)
+{
+	char *endptr;
+
+	errno = 0;
+	*val = strtoul(optarg, &endptr, 10);
+
+	if (errno != 0 || *val > max || endptr == optarg || *endptr != '\0')
+		return -1;
+	return 0;
+}
+
+static void signal_handler(int signum)
+{
+	if (signum == SIGUSR1)
+		report_requested = 1;
+	else
+		stop_requested = 1;
+}
+
+static void install_signal_handlers()
+{
+	struct sigaction action;
+
+	/* No SA_RESTART, blocking receives are interrupted to notice the flags */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signal_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+}
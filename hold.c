@@ -1,33 +1,258 @@
-#include <time.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <arpa/inet.h>
 
 #include "ping.h"
+#include "neigh.h"
+#include "targets.h"
+#include "links.h"
+#include "hold.h"
+
+extern int debug;
 
 #define TIMEOUT 60
+/* A host that didn't respond gets another magic packet after this long,
+   then after twice the time of the previous one */
+#define RETRY_FIRST_MS 1000
+
+static hold_callback online_callback;
+static hold_retry retry_callback;
+static int hold_backend;
+
+/* Hosts that responded to each attempt, the last one counting those that
+   took more, and the time from that attempt until they did */
+static struct {
+	unsigned long answered;
+	uint64_t total_ms;
+} attempt_stats[HOLD_MAX_ATTEMPTS];
+static unsigned long timeouts;
+
+static uint64_t now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* The first magic packet was just sent */
+static void first_attempt(struct target *target)
+{
+	target->attempts = 1;
+	target->attempt_ms = target->wake_ms = now_ms();
+}
+
+/* How long to wait for the host before the next attempt, 0 to give up */
+static unsigned int attempt_wait(const struct target *target)
+{
+	uint64_t now = now_ms(), deadline = target->wake_ms + TIMEOUT * 1000;
+	uint64_t wait = (uint64_t)RETRY_FIRST_MS << (target->attempts - 1);
+
+	if (now >= deadline)
+		return 0;
+	return now + wait < deadline ? wait : deadline - now;
+}
+
+/* Note how the attempts ended, returns ONLINE */
+static int attempts_done(const struct target *target, int online)
+{
+	unsigned int i = target->attempts - 1;
+
+	if (!online) {
+		__atomic_add_fetch(&timeouts, 1, __ATOMIC_RELAXED);
+		return online;
+	}
+	if (i >= HOLD_MAX_ATTEMPTS)
+		i = HOLD_MAX_ATTEMPTS - 1;
+	__atomic_add_fetch(&attempt_stats[i].answered, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&attempt_stats[i].total_ms,
+			   now_ms() - target->attempt_ms, __ATOMIC_RELAXED);
+	return online;
+}
+
+/* Send the next magic packet, the callback decides how */
+static void next_attempt(struct target *target)
+{
+	uint64_t now = now_ms();
+
+	target->attempts++;
+	if (debug)
+		printf("Attempt %u to wake a host after %lu ms, %lu ms since "
+		       "the last one\n", target->attempts,
+		       (unsigned long)(now - target->wake_ms),
+		       (unsigned long)(now - target->attempt_ms));
+	target->attempt_ms = now;
+	retry_callback(target, target->attempts);
+}
+
+static int probe_wait(struct target *target, unsigned int timeout_ms)
+{
+	if (hold_backend == HOLD_NEIGH)
+		return neigh_wait(target->neigh_host, timeout_ms);
+	return ping_wait(target->ping_host, timeout_ms);
+}
+
+/*
+ * Blocks until the host responded or the timeout passed, returns true
+ * when it responded.  Magic packets are resent with exponential backoff
+ * while waiting.
+ */
+int hold_for_online(struct target *target)
+{
+	unsigned int wait;
+	uint64_t start;
+	int online;
+
+	first_attempt(target);
+	for (;;) {
+		start = now_ms();
+		wait = attempt_wait(target);
+		online = probe_wait(target, wait);
+		/* Continue with the target that replaced it meanwhile */
+		target = target_current(target);
+		if (online)
+			return attempts_done(target, true);
+		/* Returning early means the host is probed by someone else */
+		if (now_ms() - start < wait || attempt_wait(target) == 0)
+			return attempts_done(target, false);
+		next_attempt(target);
+	}
+}
 
-void hold_for_online()
-{
-	static time_t last_time = -1;
-	time_t current_time = time(NULL);
-	int recent =
-		current_time != -1 && difftime(current_time, last_time) < 60;
-	if (!recent) {
-		int ping_ret = 0;
-		for (int ping_count = 0; ping_count < TIMEOUT && ! ping_ret;
-		     ping_count++) {
-			ping_ret = send_ping();
+static void probe_done(struct ping_host *host, int online, void *arg);
+static void neigh_done(struct neigh_host *host, int online, void *arg);
+
+static int probe_start(struct target *target, unsigned int timeout_ms)
+{
+	if (hold_backend == HOLD_NEIGH)
+		return neigh_start(target->neigh_host, timeout_ms, neigh_done,
+				   target);
+	return ping_start(target->ping_host, timeout_ms, probe_done, target);
+}
+
+/* Runs in the ping or neighbour thread when an attempt's wait ended */
+static void attempt_ended(struct target *target, int online)
+{
+	struct target *current = target_current(target);
+
+	/* Continue with the target that replaced it meanwhile, the probe's
+	   reference moves along */
+	if (current != target) {
+		target_get(current);
+		target_put(target);
+		target = current;
+	}
+	if (!online && attempt_wait(target) > 0) {
+		next_attempt(target);
+		if (probe_start(target, attempt_wait(target)))
+			return;
+	}
+	online_callback(target, attempts_done(target, online));
+}
+
+static void probe_done(struct ping_host *host, int online, void *arg)
+{
+	(void)host;
+	attempt_ended(arg, online);
+}
+
+static void neigh_done(struct neigh_host *host, int online, void *arg)
+{
+	(void)host;
+	attempt_ended(arg, online);
+}
+
+/* Start probing without blocking, the callback from setup_hold() is run
+   from the ping or neighbour thread once the host responded or the
+   timeout passed.  Magic packets are resent meanwhile. */
+int hold_start(struct target *target)
+{
+	first_attempt(target);
+	return probe_start(target, attempt_wait(target));
+}
+
+/* Watch the neighbour entry of ADDRESS, which must be numeric */
+static int neigh_add_target(struct target *target, const char *address)
+{
+	if (address != NULL) {
+		if (inet_pton(AF_INET, address, target->addr) == 1)
+			target->family = AF_INET;
+		else if (inet_pton(AF_INET6, address, target->addr) == 1)
+			target->family = AF_INET6;
+		else {
+			fprintf(stderr, "Neighbour events need an IP address, "
+				"not %s\n", address);
+			return false;
 		}
 	}
 
-	last_time = current_time;
+	target->neigh_host = neigh_add_host(&target->eaddr, target->family,
+					    target->addr, target->link);
+	return target->neigh_host != NULL;
+}
+
+/* Probe HOSTNAME for TARGET, or the target's own address when NULL */
+int hold_add_target(struct target *target, const char *hostname)
+{
+	char addr[INET6_ADDRSTRLEN + 16];
+	int ifindex = link_ifindex(target->link);
+
+	if (hold_backend == HOLD_NEIGH)
+		return neigh_add_target(target, hostname);
+
+	if (hostname == NULL) {
+		inet_ntop(target->family, target->addr, addr, sizeof(addr));
+		/* Link-local addresses are only unique on the interface */
+		if (target->family == AF_INET6 && ifindex &&
+		    IN6_IS_ADDR_LINKLOCAL((struct in6_addr *)target->addr))
+			snprintf(addr + strlen(addr), sizeof(addr) - strlen(addr),
+				 "%%%d", ifindex);
+		hostname = addr;
+	}
+
+	target->ping_host = ping_add_host(hostname);
+	return target->ping_host != NULL;
+}
+
+int setup_hold(hold_callback callback, hold_retry retry, int backend)
+{
+	online_callback = callback;
+	retry_callback = retry;
+	hold_backend = backend;
+	if (backend == HOLD_NEIGH)
+		return setup_neigh();
+	return setup_ping();
 }
 
-int setup_hold(const char *hostname)
+void hold_print_stats(FILE *stream)
 {
-	return setup_ping(hostname);
+	unsigned long answered;
+	unsigned int i;
+
+	for (i = 0; i < HOLD_MAX_ATTEMPTS; i++) {
+		answered = __atomic_load_n(&attempt_stats[i].answered,
+					   __ATOMIC_RELAXED);
+		if (answered == 0)
+			continue;
+		fprintf(stream, "%lu hosts responded to attempt %u%s, "
+			"%.0f ms after it\n", answered, i + 1,
+			i == HOLD_MAX_ATTEMPTS - 1 ? " or later" : "",
+			(double)__atomic_load_n(&attempt_stats[i].total_ms,
+						__ATOMIC_RELAXED) / answered);
+	}
+	if (timeouts)
+		fprintf(stream, "%lu hosts did not respond\n",
+			__atomic_load_n(&timeouts, __ATOMIC_RELAXED));
 }
 
 void cleanup_hold()
 {
-	cleanup_ping();
-}
\ No newline at end of file
+	if (hold_backend == HOLD_NEIGH)
+		cleanup_neigh();
+	else
+		cleanup_ping();
+}
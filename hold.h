@@ -1,8 +1,29 @@
 #ifndef ETHERWAKE_NFQUEUE_HOLD_H
 #define ETHERWAKE_NFQUEUE_HOLD_H
 
-void hold_for_online();
-int setup_hold(const char *hostname);
+#include <stdio.h>
+
+/* Attempts to wake a host that are told apart in the statistics */
+#define HOLD_MAX_ATTEMPTS 8
+
+struct target;
+
+/* How a woken host is detected */
+enum {
+	HOLD_PING,	/* ICMP echo requests */
+	HOLD_NEIGH	/* Neighbour table updates */
+};
+
+typedef void (*hold_callback)(struct target *target, int online);
+/* Sends another magic packet to a host that didn't respond yet, ATTEMPT
+   counts from 2 */
+typedef void (*hold_retry)(struct target *target, unsigned int attempt);
+
+int setup_hold(hold_callback callback, hold_retry retry, int backend);
+int hold_add_target(struct target *target, const char *hostname);
+int hold_for_online(struct target *target);
+int hold_start(struct target *target);
+void hold_print_stats(FILE *stream);
 void cleanup_hold();
 
 #endif //ETHERWAKE_NFQUEUE_HOLD_H
@@ -0,0 +1,527 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "hostdb.h"
+
+/* Fields of a line: name, ip, mac, interface, password */
+#define MAX_FIELDS 5
+#define FIELD_SIZE 64
+
+extern int debug;
+extern int verbose;
+
+struct field {
+	const char *start;
+	size_t len;
+};
+
+/*
+ * Entries are indexed by name in an open addressing hash table, so that
+ * resolving thousands of hosts doesn't scan the file for each of them like
+ * ether_hostton() does.
+ */
+struct hostdb {
+	size_t count;
+	struct hostdb_entry *entries;
+	/* Entry index plus one, 0 for an empty slot */
+	uint32_t *slots;
+	size_t mask;
+	/* Copies of the names, the file isn't kept mapped */
+	char *names;
+};
+
+static const char *db_path;
+static struct hostdb *db = NULL;
+/* Identifies the version of the file last loaded or rejected */
+static struct stat db_stat;
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t watch_thread;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond = PTHREAD_COND_INITIALIZER;
+static int watching = 0;
+static int watch_stopping = 0;
+static hostdb_changed watch_changed;
+
+static uint32_t hash_name(const char *name)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* The slot of the entry called NAME or the empty one it would go to */
+static uint32_t *find_slot(const struct hostdb *d, const char *name)
+{
+	size_t i = hash_name(name) & d->mask;
+
+	for (;; i = (i + 1) & d->mask)
+		if (d->slots[i] == 0 ||
+		    strcmp(d->entries[d->slots[i] - 1].name, name) == 0)
+			return &d->slots[i];
+}
+
+static const struct hostdb_entry *find(const struct hostdb *d,
+				       const char *name)
+{
+	uint32_t *slot;
+
+	if (d == NULL || d->count == 0)
+		return NULL;
+	slot = find_slot(d, name);
+	return *slot ? &d->entries[*slot - 1] : NULL;
+}
+
+static void free_db(struct hostdb *d)
+{
+	if (d == NULL)
+		return;
+	free(d->entries);
+	free(d->slots);
+	free(d->names);
+	free(d);
+}
+
+/* Split a line at commas or, in ethers format, at whitespace */
+static int split(const char *p, const char *end, int csv, struct field *fields)
+{
+	int count = 0;
+
+	while (p < end && count < MAX_FIELDS) {
+		const char *start, *stop;
+
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (!csv && (p == end || *p == '#'))
+			break;
+		start = p;
+		while (p < end && (csv ? *p != ',' : *p != ' ' && *p != '\t'))
+			p++;
+		stop = p;
+		while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t' ||
+					stop[-1] == '\r'))
+			stop--;
+		fields[count].start = start;
+		fields[count].len = stop - start;
+		count++;
+		if (csv && p < end)
+			p++;
+	}
+	return count;
+}
+
+/* Copy FIELD to BUF as a string */
+static int field_str(const struct field *field, char *buf, size_t size)
+{
+	if (field->len >= size)
+		return -1;
+	memcpy(buf, field->start, field->len);
+	buf[field->len] = '\0';
+	return 0;
+}
+
+/* Four or six bytes, hex separated by colons or dotted decimal */
+static int parse_passwd(const char *str, unsigned char *passwd)
+{
+	unsigned int bytes[6];
+	int count, i;
+	char end;
+
+	count = sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%c", &bytes[0], &bytes[1],
+		       &bytes[2], &bytes[3], &bytes[4], &bytes[5], &end);
+	if (count != 4 && count != 6)
+		count = sscanf(str, "%u.%u.%u.%u%c", &bytes[0], &bytes[1],
+			       &bytes[2], &bytes[3], &end);
+	if (count != 4 && count != 6)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (bytes[i] > 255)
+			return -1;
+		passwd[i] = bytes[i];
+	}
+	return count;
+}
+
+/*
+ * Lines are either in ethers format, "<mac> <name>", or comma separated
+ * values "<name>,<ip>,<mac>[,<interface>[,<password>]]", where the IP
+ * address may be left empty.
+ */
+static int parse_line(const char *p, const char *end, int number,
+		      struct hostdb_entry *entry, char **names)
+{
+	struct field fields[MAX_FIELDS];
+	struct field *name, *ip = NULL, *mac;
+	char buf[FIELD_SIZE];
+	int csv = memchr(p, ',', end - p) != NULL;
+	int count = split(p, end, csv, fields);
+
+	if (count == 0 || (count == 1 && fields[0].len == 0) ||
+	    *fields[0].start == '#')
+		return 0;
+
+	if (csv) {
+		name = &fields[0];
+		ip = &fields[1];
+		mac = &fields[2];
+		/* A header naming the columns */
+		if (number == 1 && name->len == 4 &&
+		    strncasecmp(name->start, "name", 4) == 0)
+			return 0;
+	} else {
+		mac = &fields[0];
+		name = &fields[1];
+	}
+	if (count < (csv ? 3 : 2) || name->len == 0) {
+		fprintf(stderr, "%s:%d: Expected %s\n", db_path, number,
+			csv ? "<name>,<ip>,<mac>[,<interface>[,<password>]]" :
+			"<mac> <name>");
+		return -1;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	entry->line = number;
+	if (field_str(mac, buf, sizeof(buf)) < 0 ||
+	    ether_aton_r(buf, &entry->eaddr) == NULL) {
+		fprintf(stderr, "%s:%d: Invalid MAC address\n", db_path, number);
+		return -1;
+	}
+
+	if (ip != NULL && ip->len > 0) {
+		if (field_str(ip, buf, sizeof(buf)) < 0)
+			buf[0] = '\0';
+		entry->family = strchr(buf, ':') != NULL ? AF_INET6 : AF_INET;
+		if (inet_pton(entry->family, buf, entry->addr) != 1) {
+			fprintf(stderr, "%s:%d: Invalid IP address\n", db_path,
+				number);
+			return -1;
+		}
+	}
+
+	if (csv && count > 3 &&
+	    field_str(&fields[3], entry->ifname, sizeof(entry->ifname)) < 0) {
+		fprintf(stderr, "%s:%d: Invalid interface\n", db_path, number);
+		return -1;
+	}
+
+	if (csv && count > 4 && fields[4].len > 0 &&
+	    (field_str(&fields[4], buf, sizeof(buf)) < 0 ||
+	     (entry->passwd_size = parse_passwd(buf, entry->passwd)) < 0)) {
+		fprintf(stderr, "%s:%d: Invalid password\n", db_path, number);
+		return -1;
+	}
+
+	memcpy(*names, name->start, name->len);
+	(*names)[name->len] = '\0';
+	entry->name = *names;
+	*names += name->len + 1;
+	return 1;
+}
+
+/* Parse the SIZE bytes at DATA into a new database */
+static struct hostdb *parse(const char *data, size_t size)
+{
+	const char *p = data, *end = data + size, *eol;
+	struct hostdb *d;
+	size_t lines = 1, slots = 16;
+	char *names;
+	int number = 0, ret;
+
+	for (eol = data; (eol = memchr(eol, '\n', end - eol)) != NULL; eol++)
+		lines++;
+	while (slots < lines * 2)
+		slots *= 2;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL ||
+	    (d->entries = calloc(lines, sizeof(*d->entries))) == NULL ||
+	    (d->slots = calloc(slots, sizeof(*d->slots))) == NULL ||
+	    (d->names = malloc(size + 1)) == NULL) {
+		perror("calloc");
+		free_db(d);
+		return NULL;
+	}
+	d->mask = slots - 1;
+	names = d->names;
+
+	for (; p < end; p = eol + 1) {
+		struct hostdb_entry *entry = &d->entries[d->count];
+		uint32_t *slot;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		number++;
+
+		ret = parse_line(p, eol, number, entry, &names);
+		if (ret < 0) {
+			free_db(d);
+			return NULL;
+		}
+		if (ret == 0)
+			continue;
+
+		/* The first one wins, like with ether_hostton() */
+		slot = find_slot(d, entry->name);
+		if (*slot != 0) {
+			fprintf(stderr, "%s:%d: Duplicate host %s, using line %d\n",
+				db_path, number, entry->name,
+				d->entries[*slot - 1].line);
+			continue;
+		}
+		*slot = ++d->count;
+	}
+	return d;
+}
+
+/* Map and parse the file, ST describes it afterwards */
+static struct hostdb *load(struct stat *st)
+{
+	struct hostdb *d;
+	void *data;
+	int fd;
+
+	fd = open(db_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, st) < 0) {
+		perror(db_path);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (st->st_size == 0) {
+		close(fd);
+		return parse("", 0);
+	}
+
+	data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(db_path);
+		return NULL;
+	}
+	madvise(data, st->st_size, MADV_SEQUENTIAL);
+	d = parse(data, st->st_size);
+	munmap(data, st->st_size);
+	return d;
+}
+
+/* Load the hosts in the file at PATH */
+int hostdb_open(const char *path)
+{
+	struct hostdb *d;
+
+	db_path = path;
+	d = load(&db_stat);
+	if (d == NULL)
+		return false;
+	db = d;
+	if (verbose)
+		printf("Loaded %zu hosts from %s\n", db->count, path);
+	return true;
+}
+
+/* Copy the entry called NAME to ENTRY, returns false if there is none */
+int hostdb_lookup(const char *name, struct hostdb_entry *entry)
+{
+	const struct hostdb_entry *found;
+
+	pthread_mutex_lock(&db_lock);
+	found = find(db, name);
+	if (found != NULL)
+		*entry = *found;
+	pthread_mutex_unlock(&db_lock);
+	return found != NULL;
+}
+
+size_t hostdb_count()
+{
+	size_t count;
+
+	pthread_mutex_lock(&db_lock);
+	count = db ? db->count : 0;
+	pthread_mutex_unlock(&db_lock);
+	return count;
+}
+
+/* Stops at and returns the first non-zero result of FN */
+int hostdb_for_each(int (*fn)(const struct hostdb_entry *entry))
+{
+	size_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&db_lock);
+	for (i = 0; db != NULL && i < db->count && ret == 0; i++)
+		ret = fn(&db->entries[i]);
+	pthread_mutex_unlock(&db_lock);
+	return ret;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int same_entry(const struct hostdb_entry *a,
+		      const struct hostdb_entry *b)
+{
+	return a->family == b->family &&
+		memcmp(a->addr, b->addr, sizeof(a->addr)) == 0 &&
+		memcmp(&a->eaddr, &b->eaddr, sizeof(a->eaddr)) == 0 &&
+		strcmp(a->ifname, b->ifname) == 0 &&
+		a->passwd_size == b->passwd_size &&
+		memcmp(a->passwd, b->passwd, a->passwd_size) == 0;
+}
+
+/*
+ * Load the file again if it was changed or replaced since and pass the
+ * differences to CHANGED, removals first.  CHANGED is called without the
+ * lock, so it may look up hosts, and both databases stay as only the
+ * watch thread reloads.  A file that fails to parse is ignored until it
+ * changes again.  Returns 1 after a reload, 0 if nothing changed and -1
+ * on errors.
+ */
+int hostdb_reload(hostdb_changed changed)
+{
+	struct hostdb *d, *old_db;
+	struct stat st;
+	size_t i;
+
+	if (stat(db_path, &st) < 0) {
+		if (debug)
+			perror(db_path);
+		return -1;
+	}
+	if (same_file(&st, &db_stat))
+		return 0;
+
+	d = load(&st);
+	db_stat = st;
+	if (d == NULL) {
+		fprintf(stderr, "Keeping the hosts loaded from %s before\n",
+			db_path);
+		return -1;
+	}
+
+	pthread_mutex_lock(&db_lock);
+	old_db = db;
+	db = d;
+	pthread_mutex_unlock(&db_lock);
+
+	for (i = 0; changed && old_db && i < old_db->count; i++)
+		if (find(d, old_db->entries[i].name) == NULL)
+			changed(&old_db->entries[i], NULL);
+	for (i = 0; changed && i < d->count; i++) {
+		const struct hostdb_entry *old = find(old_db, d->entries[i].name);
+
+		if (old == NULL || !same_entry(old, &d->entries[i]))
+			changed(old, &d->entries[i]);
+	}
+	free_db(old_db);
+
+	if (verbose)
+		printf("Reloaded %zu hosts from %s\n", d->count, db_path);
+	return 1;
+}
+
+static void *watch_main(void *data)
+{
+	struct timespec next;
+
+	(void)data;
+
+	pthread_mutex_lock(&watch_lock);
+	clock_gettime(CLOCK_REALTIME, &next);
+	while (!watch_stopping) {
+		next.tv_sec += HOSTDB_CHECK_INTERVAL;
+		while (!watch_stopping &&
+		       pthread_cond_timedwait(&watch_cond, &watch_lock,
+					      &next) != ETIMEDOUT)
+			;
+		if (watch_stopping)
+			break;
+		pthread_mutex_unlock(&watch_lock);
+		hostdb_reload(watch_changed);
+		pthread_mutex_lock(&watch_lock);
+	}
+	pthread_mutex_unlock(&watch_lock);
+	return NULL;
+}
+
+/* Reload the file every HOSTDB_CHECK_INTERVAL seconds if it changed */
+int hostdb_watch_start(hostdb_changed changed)
+{
+	sigset_t all, old;
+	int ret;
+
+	watch_changed = changed;
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&watch_thread, NULL, watch_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating hosts thread\n");
+		return false;
+	}
+	watching = 1;
+	return true;
+}
+
+void hostdb_watch_stop()
+{
+	if (!watching)
+		return;
+
+	pthread_mutex_lock(&watch_lock);
+	watch_stopping = 1;
+	pthread_cond_signal(&watch_cond);
+	pthread_mutex_unlock(&watch_lock);
+	pthread_join(watch_thread, NULL);
+	watching = 0;
+}
+
+void hostdb_close()
+{
+	hostdb_watch_stop();
+	pthread_mutex_lock(&db_lock);
+	free_db(db);
+	db = NULL;
+	pthread_mutex_unlock(&db_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef ETHERWAKE_NFQUEUE_HOSTDB_H
+#define ETHERWAKE_NFQUEUE_HOSTDB_H
+
+#include <stddef.h>
+#include <netinet/ether.h>
+
+/* Seconds between checks whether the database file changed */
+#define HOSTDB_CHECK_INTERVAL 5
+/* IFNAMSIZ, without pulling in either of the conflicting if.h headers */
+#define HOSTDB_IFNAME_SIZE 16
+
+struct hostdb_entry {
+	/* Only valid until the file is reloaded */
+	const char *name;
+	int line;
+	/* 0 without an IP address */
+	int family;
+	unsigned char addr[16];
+	struct ether_addr eaddr;
+	/* Empty unless given */
+	char ifname[HOSTDB_IFNAME_SIZE];
+	unsigned char passwd[6];
+	int passwd_size;
+};
+
+/* Called for each entry that was removed (ENTRY is NULL), added (OLD is
+   NULL) or changed when the file is reloaded */
+typedef void (*hostdb_changed)(const struct hostdb_entry *old,
+			       const struct hostdb_entry *entry);
+
+int hostdb_open(const char *path);
+int hostdb_lookup(const char *name, struct hostdb_entry *entry);
+size_t hostdb_count();
+int hostdb_for_each(int (*fn)(const struct hostdb_entry *entry));
+int hostdb_reload(hostdb_changed changed);
+int hostdb_watch_start(hostdb_changed changed);
+void hostdb_watch_stop();
+void hostdb_close();
+
+#endif //ETHERWAKE_NFQUEUE_HOSTDB_H
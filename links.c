@@ -0,0 +1,414 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/eventfd.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+
+#include "links.h"
+
+#define HWADDR_SIZE 6
+/* How often reading all interfaces is retried after it failed */
+#define RESYNC_INTERVAL_MS 1000
+
+extern int debug;
+extern int verbose;
+
+/*
+ * Interfaces by name, kept current from rtnetlink link events, so an
+ * interface that is recreated, e.g. by a bridge reload or a PPPoE
+ * reconnect, is used again under its new index.  Links handed out by
+ * links_get() stay until links_stop(), others go with their interface.
+ */
+struct link {
+	char name[LINK_NAME_SIZE];
+	/* 0 while the interface doesn't exist, read without the lock */
+	int ifindex;
+	unsigned char hwaddr[HWADDR_SIZE];
+	int has_hwaddr;
+	int wanted;
+	/* Dump the interface was last seen in */
+	unsigned int generation;
+	struct link *next;
+};
+
+static struct mnl_socket *nl = NULL;
+static unsigned int seq;
+static int event_fd = -1;
+static pthread_t thread;
+static int running = 0;
+static int stopping = 0;
+
+/* Protects the list and the addresses.  Interfaces come and go rarely,
+   the list is only walked for their events and by links_get(). */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct link *links = NULL;
+static unsigned int generation = 0;
+
+static struct link *find_link(const char *name)
+{
+	struct link *link;
+
+	for (link = links; link != NULL; link = link->next)
+		if (strcmp(link->name, name) == 0)
+			return link;
+	return NULL;
+}
+
+static struct link *add_link(const char *name)
+{
+	struct link *link = calloc(1, sizeof(*link));
+
+	if (link == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	strcpy(link->name, name);
+	link->next = links;
+	links = link;
+	return link;
+}
+
+static void set_ifindex(struct link *link, int ifindex)
+{
+	if (__atomic_exchange_n(&link->ifindex, ifindex, __ATOMIC_RELAXED) ==
+	    ifindex || ! link->wanted || ! (verbose || debug))
+		return;
+	if (ifindex)
+		printf("Interface %s has index %d\n", link->name, ifindex);
+	else
+		printf("Interface %s is gone\n", link->name);
+}
+
+/* The interface of the link *PREV points to is gone, tells whether the
+   link was dropped from the list */
+static int forget(struct link **prev)
+{
+	struct link *link = *prev;
+
+	set_ifindex(link, 0);
+	if (link->wanted)
+		return false;
+	*prev = link->next;
+	free(link);
+	return true;
+}
+
+/* Called with the lock held for each interface that was added, changed
+   or REMOVED */
+static void update(int ifindex, const char *name, const unsigned char *hwaddr,
+		   int removed)
+{
+	struct link **prev = &links, *link, *found = NULL;
+
+	while ((link = *prev) != NULL) {
+		if (! removed && strcmp(link->name, name) == 0)
+			found = link;
+		/* Removed or renamed */
+		else if (link->ifindex == ifindex && forget(prev))
+			continue;
+		prev = &link->next;
+	}
+
+	if (removed || (found == NULL && (found = add_link(name)) == NULL))
+		return;
+	set_ifindex(found, ifindex);
+	found->generation = generation;
+	found->has_hwaddr = hwaddr != NULL;
+	if (hwaddr != NULL)
+		memcpy(found->hwaddr, hwaddr, HWADDR_SIZE);
+}
+
+static int link_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, IFLA_MAX) < 0)
+		return MNL_CB_OK;
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+static int link_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlattr *tb[IFLA_MAX + 1] = { NULL, };
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	const unsigned char *hwaddr = NULL;
+	const char *name;
+
+	(void)data;
+
+	if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+		return MNL_CB_OK;
+	mnl_attr_parse(nlh, sizeof(*ifm), link_attr_cb, tb);
+	if (tb[IFLA_IFNAME] == NULL)
+		return MNL_CB_OK;
+	name = mnl_attr_get_str(tb[IFLA_IFNAME]);
+	if (strnlen(name, LINK_NAME_SIZE) == LINK_NAME_SIZE)
+		return MNL_CB_OK;
+	/* Tunnels and PPP have none, others a longer one */
+	if (tb[IFLA_ADDRESS] != NULL &&
+	    mnl_attr_get_payload_len(tb[IFLA_ADDRESS]) == HWADDR_SIZE)
+		hwaddr = mnl_attr_get_payload(tb[IFLA_ADDRESS]);
+
+	pthread_mutex_lock(&lock);
+	update(ifm->ifi_index, name, hwaddr, nlh->nlmsg_type == RTM_DELLINK);
+	pthread_mutex_unlock(&lock);
+	return MNL_CB_OK;
+}
+
+/*
+ * Read all interfaces, forgetting those that went away unnoticed.  The
+ * dump has a socket of its own, events sent meanwhile carry the pid and
+ * sequence number of whoever caused them and would fail its checks.
+ */
+static int dump()
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct mnl_socket *dump_nl;
+	struct nlmsghdr *nlh;
+	struct rtgenmsg *rt;
+	struct link **prev, *link;
+	ssize_t n;
+	int ret;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = ++seq;
+	rt = mnl_nlmsg_put_extra_header(nlh, sizeof(*rt));
+	rt->rtgen_family = AF_UNSPEC;
+
+	dump_nl = mnl_socket_open(NETLINK_ROUTE);
+	if (dump_nl == NULL) {
+		fprintf(stderr, "mnl_socket_open() failed\n");
+		return false;
+	}
+	if (mnl_socket_bind(dump_nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		fprintf(stderr, "mnl_socket_bind() failed\n");
+		mnl_socket_close(dump_nl);
+		return false;
+	}
+
+	pthread_mutex_lock(&lock);
+	generation++;
+	pthread_mutex_unlock(&lock);
+
+	if (mnl_socket_sendto(dump_nl, nlh, nlh->nlmsg_len) < 0) {
+		perror("mnl_socket_sendto(RTM_GETLINK)");
+		mnl_socket_close(dump_nl);
+		return false;
+	}
+	/* Events of changes meanwhile are handled after the dump */
+	do {
+		n = mnl_socket_recvfrom(dump_nl, buf, sizeof(buf));
+		if (n < 0) {
+			perror("mnl_socket_recvfrom(RTM_GETLINK)");
+			break;
+		}
+		ret = mnl_cb_run(buf, n, seq, mnl_socket_get_portid(dump_nl),
+				 link_cb, NULL);
+		if (ret < 0)
+			perror("RTM_GETLINK");
+	} while (ret > MNL_CB_STOP);
+	mnl_socket_close(dump_nl);
+	if (n < 0 || ret < 0)
+		return false;
+
+	pthread_mutex_lock(&lock);
+	prev = &links;
+	while ((link = *prev) != NULL) {
+		if (link->generation != generation && forget(prev))
+			continue;
+		prev = &link->next;
+	}
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+static void *links_thread(void *data)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct pollfd fds[2];
+	int resync = 0;
+	ssize_t n;
+
+	(void)data;
+
+	fds[0].fd = mnl_socket_get_fd(nl);
+	fds[0].events = POLLIN;
+	fds[1].fd = event_fd;
+	fds[1].events = POLLIN;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (poll(fds, 2, resync ? RESYNC_INTERVAL_MS : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (resync)
+			resync = ! dump();
+		if (! (fds[0].revents & POLLIN))
+			continue;
+
+		n = recv(fds[0].fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0 && errno == ENOBUFS) {
+			if (verbose || debug)
+				printf("Missed link events, reading all interfaces\n");
+			resync = ! dump();
+		} else if (n < 0 && errno != EAGAIN)
+			perror("recv(link events)");
+		else if (n > 0)
+			mnl_cb_run(buf, n, 0, 0, link_cb, NULL);
+	}
+
+	return NULL;
+}
+
+/* Read the interfaces and follow their changes from a thread of its own */
+int links_start()
+{
+	sigset_t all, old;
+	int ret;
+
+	if (running)
+		return true;
+
+	nl = mnl_socket_open(NETLINK_ROUTE);
+	if (nl == NULL) {
+		fprintf(stderr, "mnl_socket_open() failed\n");
+		return false;
+	}
+	if (mnl_socket_bind(nl, RTMGRP_LINK, MNL_SOCKET_AUTOPID) < 0) {
+		fprintf(stderr, "mnl_socket_bind() failed\n");
+		return false;
+	}
+	seq = time(NULL);
+	if (! dump())
+		return false;
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0) {
+		perror("eventfd");
+		return false;
+	}
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, links_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating link thread\n");
+		return false;
+	}
+	running = 1;
+
+	return true;
+}
+
+/* The interface called NAME, which may not exist (yet) */
+struct link *links_get(const char *name)
+{
+	struct link *link;
+
+	if (strlen(name) >= LINK_NAME_SIZE) {
+		fprintf(stderr, "Invalid interface name %s\n", name);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lock);
+	link = find_link(name);
+	if (link == NULL)
+		link = add_link(name);
+	if (link != NULL)
+		link->wanted = 1;
+	pthread_mutex_unlock(&lock);
+	return link;
+}
+
+const char *link_name(const struct link *link)
+{
+	return link->name;
+}
+
+/* The current index of LINK, 0 while it doesn't exist or without one */
+int link_ifindex(const struct link *link)
+{
+	if (link == NULL)
+		return 0;
+	return __atomic_load_n(&link->ifindex, __ATOMIC_RELAXED);
+}
+
+/* Copies the Ethernet address of LINK to HWADDR, if it has one */
+int link_hwaddr(const struct link *link, unsigned char *hwaddr)
+{
+	int ret = false;
+
+	if (link == NULL)
+		return false;
+
+	pthread_mutex_lock(&lock);
+	if (link->ifindex && link->has_hwaddr) {
+		memcpy(hwaddr, link->hwaddr, HWADDR_SIZE);
+		ret = true;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void links_stop()
+{
+	struct link *link, *next;
+	uint64_t one = 1;
+
+	if (running) {
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		if (write(event_fd, &one, sizeof(one)) < 0)
+			perror("write(eventfd)");
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	for (link = links; link != NULL; link = next) {
+		next = link->next;
+		free(link);
+	}
+	links = NULL;
+	pthread_mutex_unlock(&lock);
+
+	if (event_fd >= 0)
+		close(event_fd);
+	event_fd = -1;
+	if (nl != NULL)
+		mnl_socket_close(nl);
+	nl = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef ETHERWAKE_NFQUEUE_LINKS_H
+#define ETHERWAKE_NFQUEUE_LINKS_H
+
+/* IFNAMSIZ, without pulling in either of the conflicting if.h headers */
+#define LINK_NAME_SIZE 16
+
+struct link;
+
+int links_start();
+struct link *links_get(const char *name);
+const char *link_name(const struct link *link);
+int link_ifindex(const struct link *link);
+int link_hwaddr(const struct link *link, unsigned char *hwaddr);
+void links_stop();
+
+#endif //ETHERWAKE_NFQUEUE_LINKS_H
@@ -0,0 +1,400 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "match.h"
+
+#define LINE_SIZE 256
+
+/* TCP header flags in the order of their bits */
+static const char *flag_names[] = {
+	"FIN", "SYN", "RST", "PSH", "ACK", "URG", "ECE", "CWR"
+};
+
+struct rule {
+	int action;
+	int line;
+	/* 0 without a source prefix */
+	int family;
+	unsigned char net[16];
+	unsigned char mask[16];
+	unsigned long hits;
+};
+
+static struct rule rules[MATCH_MAX_RULES];
+static unsigned int rule_count = 0;
+static int default_action = MATCH_WAKE;
+static unsigned long default_hits = 0;
+
+/*
+ * The rules are compiled into one bit mask per header field value, with
+ * bit N set when rule N accepts that value.  A packet is matched by the
+ * lowest bit left after ANDing the masks of its protocol, destination port
+ * and TCP flags, so the work per packet doesn't grow with the ports or
+ * flags listed in the rules.  Only source prefixes are compared per rule.
+ */
+static uint32_t proto_rules[256];
+/* Indexed by the TCP flags, flags_any is used for other packets */
+static uint32_t flags_rules[256];
+static uint32_t flags_any;
+/* Indexed by destination port, NULL when no rule names a port */
+static uint32_t *port_rules = NULL;
+static uint32_t port_any;
+static uint32_t source_rules;
+
+static int parse_action(const char *word)
+{
+	if (word == NULL)
+		return -1;
+	if (strcmp(word, "wake") == 0)
+		return MATCH_WAKE;
+	if (strcmp(word, "ignore") == 0)
+		return MATCH_IGNORE;
+	return -1;
+}
+
+static int parse_protocol(const char *word)
+{
+	char *endptr;
+	long proto;
+
+	if (strcmp(word, "icmp") == 0)
+		return IPPROTO_ICMP;
+	if (strcmp(word, "tcp") == 0)
+		return IPPROTO_TCP;
+	if (strcmp(word, "udp") == 0)
+		return IPPROTO_UDP;
+	if (strcmp(word, "icmpv6") == 0)
+		return IPPROTO_ICMPV6;
+
+	proto = strtol(word, &endptr, 10);
+	if (endptr == word || *endptr != '\0' || proto < 0 || proto > 255)
+		return -1;
+	return proto;
+}
+
+static int parse_port_range(const char *word, int *min, int *max)
+{
+	char *endptr;
+	long val;
+
+	val = strtol(word, &endptr, 10);
+	if (endptr == word || val < 0 || val > 65535)
+		return -1;
+	*min = *max = val;
+
+	if (*endptr == ':') {
+		word = endptr + 1;
+		val = strtol(word, &endptr, 10);
+		if (endptr == word || val < *min || val > 65535)
+			return -1;
+		*max = val;
+	}
+	return *endptr == '\0' ? 0 : -1;
+}
+
+/* A comma-separated list of flag names */
+static int parse_flag_list(char *word)
+{
+	char *name, *saveptr;
+	unsigned int i;
+	int flags = 0;
+
+	for (name = strtok_r(word, ",", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; i < 8; i++)
+			if (strcasecmp(name, flag_names[i]) == 0)
+				break;
+		if (i == 8)
+			return -1;
+		flags |= 1 << i;
+	}
+	return flags;
+}
+
+/* SET[/MASK], the flags in MASK must be exactly those in SET */
+static int parse_flags(char *word, int *set, int *mask)
+{
+	char *slash = strchr(word, '/');
+
+	if (slash != NULL)
+		*slash = '\0';
+	*set = parse_flag_list(word);
+	*mask = slash != NULL ? parse_flag_list(slash + 1) : *set;
+	if (*set < 0 || *mask <= 0 || (*set & ~*mask) != 0)
+		return -1;
+	return 0;
+}
+
+static int parse_prefix(char *word, struct rule *rule)
+{
+	char *slash = strchr(word, '/');
+	unsigned int i, bits;
+	long prefix;
+	char *endptr;
+
+	if (slash != NULL)
+		*slash = '\0';
+	if (inet_pton(AF_INET, word, rule->net) == 1)
+		rule->family = AF_INET;
+	else if (inet_pton(AF_INET6, word, rule->net) == 1)
+		rule->family = AF_INET6;
+	else
+		return -1;
+
+	bits = rule->family == AF_INET ? 32 : 128;
+	prefix = bits;
+	if (slash != NULL) {
+		prefix = strtol(slash + 1, &endptr, 10);
+		if (endptr == slash + 1 || *endptr != '\0' || prefix < 0 ||
+		    prefix > (long)bits)
+			return -1;
+	}
+
+	for (i = 0; i < bits / 8; i++) {
+		int n = prefix - i * 8;
+
+		rule->mask[i] = n >= 8 ? 0xFF : n > 0 ? 0xFF << (8 - n) : 0;
+		rule->net[i] &= rule->mask[i];
+	}
+	return 0;
+}
+
+/* Add the rule on LINE to the tables as rule number rule_count */
+static int parse_rule(char *line, int number, const char *path)
+{
+	struct rule *rule;
+	uint32_t bit;
+	int proto = -1, port_min = -1, port_max = -1, set = 0, mask = 0;
+	char *word, *saveptr;
+	unsigned int i;
+
+	word = strtok_r(line, " \t\r\n", &saveptr);
+	if (word == NULL || *word == '#')
+		return 0;
+
+	if (strcmp(word, "default") == 0) {
+		default_action =
+			parse_action(strtok_r(NULL, " \t\r\n", &saveptr));
+		if (default_action < 0) {
+			fprintf(stderr, "%s:%d: Expected wake or ignore\n",
+				path, number);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (rule_count == MATCH_MAX_RULES) {
+		fprintf(stderr, "%s:%d: More than %d rules\n", path, number,
+			MATCH_MAX_RULES);
+		return -1;
+	}
+	rule = &rules[rule_count];
+	bit = 1u << rule_count;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->line = number;
+	rule->action = parse_action(word);
+	if (rule->action < 0) {
+		fprintf(stderr, "%s:%d: Rules start with wake, ignore or "
+			"default\n", path, number);
+		return -1;
+	}
+
+	while ((word = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL &&
+	       *word != '#') {
+		char *arg = NULL;
+		int ret = 0;
+
+		if (strcmp(word, "port") == 0 || strcmp(word, "from") == 0 ||
+		    strcmp(word, "flags") == 0) {
+			arg = strtok_r(NULL, " \t\r\n", &saveptr);
+			if (arg == NULL) {
+				fprintf(stderr, "%s:%d: %s needs a value\n",
+					path, number, word);
+				return -1;
+			}
+		}
+
+		if (strcmp(word, "port") == 0)
+			ret = parse_port_range(arg, &port_min, &port_max);
+		else if (strcmp(word, "from") == 0)
+			ret = parse_prefix(arg, rule);
+		else if (strcmp(word, "flags") == 0)
+			ret = parse_flags(arg, &set, &mask);
+		else if (proto < 0 && (proto = parse_protocol(word)) >= 0)
+			continue;
+		else
+			arg = word;
+
+		if (ret < 0 || arg == word) {
+			fprintf(stderr, "%s:%d: Invalid %s\n", path, number,
+				arg);
+			return -1;
+		}
+	}
+
+	if (port_min >= 0 && proto != IPPROTO_TCP && proto != IPPROTO_UDP) {
+		fprintf(stderr, "%s:%d: Ports need tcp or udp\n", path, number);
+		return -1;
+	}
+	if (mask && proto != IPPROTO_TCP) {
+		fprintf(stderr, "%s:%d: Flags need tcp\n", path, number);
+		return -1;
+	}
+	for (i = 0; i < 256; i++)
+		if (proto < 0 || (int)i == proto)
+			proto_rules[i] |= bit;
+
+	if (port_min < 0) {
+		port_any |= bit;
+	} else {
+		if (port_rules == NULL) {
+			port_rules = calloc(65536, sizeof(*port_rules));
+			if (port_rules == NULL) {
+				perror("calloc");
+				return -1;
+			}
+		}
+		for (i = port_min; i <= (unsigned int)port_max; i++)
+			port_rules[i] |= bit;
+	}
+
+	if (mask == 0)
+		flags_any |= bit;
+	for (i = 0; i < 256; i++)
+		if (((int)i & mask) == set)
+			flags_rules[i] |= bit;
+
+	if (rule->family)
+		source_rules |= bit;
+
+	rule_count++;
+	return 0;
+}
+
+int match_load(const char *path)
+{
+	char line[LINE_SIZE];
+	int number = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		number++;
+		if (parse_rule(line, number, path) < 0) {
+			fclose(file);
+			return 0;
+		}
+	}
+	fclose(file);
+	return 1;
+}
+
+static int source_matches(const struct rule *rule, int family,
+			  const unsigned char *src)
+{
+	unsigned int i;
+
+	if (rule->family != family)
+		return 0;
+	for (i = 0; i < (family == AF_INET ? 4 : 16); i++)
+		if ((src[i] & rule->mask[i]) != rule->net[i])
+			return 0;
+	return 1;
+}
+
+/* PACKET starts with the IP header */
+int match_packet(const unsigned char *packet, size_t len)
+{
+	const unsigned char *src, *l4;
+	unsigned int proto, hlen;
+	uint32_t candidates, ports = port_any, flags = flags_any;
+	int family, first_fragment = 1;
+
+	if (len >= 20 && packet[0] >> 4 == 4) {
+		family = AF_INET;
+		hlen = (packet[0] & 0x0F) * 4;
+		proto = packet[9];
+		src = packet + 12;
+		first_fragment = ((packet[6] & 0x1F) | packet[7]) == 0;
+	} else if (len >= 40 && packet[0] >> 4 == 6) {
+		/* Extension headers aren't followed */
+		family = AF_INET6;
+		hlen = 40;
+		proto = packet[6];
+		src = packet + 8;
+	} else {
+		__atomic_add_fetch(&default_hits, 1, __ATOMIC_RELAXED);
+		return default_action;
+	}
+	l4 = packet + hlen;
+
+	if (first_fragment && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    len >= hlen + 4) {
+		if (port_rules != NULL)
+			ports |= port_rules[l4[2] << 8 | l4[3]];
+		if (proto == IPPROTO_TCP && len >= hlen + 14)
+			flags = flags_rules[l4[13]];
+	}
+	candidates = proto_rules[proto] & ports & flags;
+
+	while (candidates) {
+		unsigned int i = __builtin_ctz(candidates);
+
+		if (!(source_rules & 1u << i) ||
+		    source_matches(&rules[i], family, src)) {
+			__atomic_add_fetch(&rules[i].hits, 1, __ATOMIC_RELAXED);
+			return rules[i].action;
+		}
+		candidates &= candidates - 1;
+	}
+
+	__atomic_add_fetch(&default_hits, 1, __ATOMIC_RELAXED);
+	return default_action;
+}
+
+void match_print_stats(FILE *stream)
+{
+	static const char *action_names[] = { "wake", "ignore" };
+	unsigned int i;
+
+	for (i = 0; i < rule_count; i++)
+		fprintf(stream, "Rule in line %d (%s): %lu packets\n",
+			rules[i].line, action_names[rules[i].action],
+			__atomic_load_n(&rules[i].hits, __ATOMIC_RELAXED));
+	fprintf(stream, "Default (%s): %lu packets\n",
+		action_names[default_action],
+		__atomic_load_n(&default_hits, __ATOMIC_RELAXED));
+}
+
+void match_cleanup()
+{
+	free(port_rules);
+	port_rules = NULL;
+}
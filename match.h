@@ -0,0 +1,22 @@
+#ifndef ETHERWAKE_NFQUEUE_MATCH_H
+#define ETHERWAKE_NFQUEUE_MATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Bytes of each packet needed to match on L3 and L4 headers */
+#define MATCH_COPY_RANGE 64
+#define MATCH_MAX_RULES 32
+
+/* Actions of a rule */
+enum {
+	MATCH_WAKE,
+	MATCH_IGNORE
+};
+
+int match_load(const char *path);
+int match_packet(const unsigned char *packet, size_t len);
+void match_print_stats(FILE *stream);
+void match_cleanup();
+
+#endif //ETHERWAKE_NFQUEUE_MATCH_H
@@ -0,0 +1,285 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+/* Sub-buckets per power of two, values within a bucket differ by at most
+   1 / SUB_BUCKETS */
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+/* Exported bucket bounds, powers of two from about 1 us to 69 s */
+#define EXPORT_MIN_SHIFT 10
+#define EXPORT_MAX_SHIFT 36
+
+/*
+ * Log-linear histograms in the style of HdrHistogram.  Recording is a
+ * handful of relaxed atomic increments, so it is done on the receive path
+ * of every thread without locks.
+ */
+struct histogram {
+	const char *name;
+	const char *help;
+	uint64_t counts[BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+};
+
+static struct histogram histograms[METRIC_COUNT] = {
+	[METRIC_VERDICT] = { "verdict_latency_seconds",
+			     "Time from receiving a packet to its verdict" },
+	[METRIC_SEND] = { "send_duration_seconds",
+			  "Time to send a batch of magic packets" },
+	[METRIC_WAKE] = { "wake_duration_seconds",
+			  "Time from waking a host until it responded" },
+};
+
+static pthread_t export_thread;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+static int exporting = 0;
+static int export_stopping = 0;
+static const char *export_path;
+static unsigned int export_interval_s;
+static void (*export_write)(FILE *stream);
+
+static unsigned int bucket_of(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < SUB_BUCKETS)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return (msb - SUB_BITS + 1) * SUB_BUCKETS +
+		((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Smallest value falling into BUCKET */
+static uint64_t bucket_start(unsigned int bucket)
+{
+	unsigned int msb = bucket / SUB_BUCKETS + SUB_BITS - 1;
+
+	if (bucket < SUB_BUCKETS)
+		return bucket;
+	return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) <<
+		(msb - SUB_BITS);
+}
+
+void metrics_record_n(int metric, uint64_t ns, uint64_t count)
+{
+	struct histogram *h = &histograms[metric];
+	uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->counts[bucket_of(ns)], count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum_ns, ns * count, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void metrics_record(int metric, uint64_t ns)
+{
+	metrics_record_n(metric, ns, 1);
+}
+
+/* Returns the end of the bucket holding PERCENTILE of the values, so the
+   result errs on the slow side */
+uint64_t metrics_percentile(int metric, double percentile)
+{
+	struct histogram *h = &histograms[metric];
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	uint64_t rank = count * percentile / 100.0, seen = 0;
+	unsigned int i;
+
+	if (count == 0)
+		return 0;
+	for (i = 0; i < BUCKETS; i++) {
+		seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		if (seen > rank)
+			break;
+	}
+	if (i + 1 >= BUCKETS || bucket_start(i + 1) - 1 > max)
+		return max;
+	return bucket_start(i + 1) - 1;
+}
+
+void metrics_print(FILE *stream)
+{
+	unsigned int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		struct histogram *h = &histograms[i];
+		uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+		if (count == 0)
+			continue;
+		fprintf(stream, "%s: %lu values, p50 %.1f us, p99 %.1f us, "
+			"max %.1f us\n", h->name, (unsigned long)count,
+			metrics_percentile(i, 50) / 1000.0,
+			metrics_percentile(i, 99) / 1000.0,
+			__atomic_load_n(&h->max_ns, __ATOMIC_RELAXED) / 1000.0);
+	}
+}
+
+/* Prometheus text format, cumulative buckets at powers of two, which are
+   bucket boundaries of the histograms as well */
+void metrics_write_histograms(FILE *stream)
+{
+	unsigned int i, shift, bucket;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		struct histogram *h = &histograms[i];
+		uint64_t cumulative = 0;
+
+		fprintf(stream, "# HELP etherwake_nfqueue_%s %s.\n", h->name,
+			h->help);
+		fprintf(stream, "# TYPE etherwake_nfqueue_%s histogram\n",
+			h->name);
+
+		bucket = 0;
+		for (shift = EXPORT_MIN_SHIFT; shift <= EXPORT_MAX_SHIFT;
+		     shift++) {
+			unsigned int end = bucket_of(1ull << shift);
+
+			for (; bucket < end; bucket++)
+				cumulative += __atomic_load_n(&h->counts[bucket],
+							      __ATOMIC_RELAXED);
+			fprintf(stream,
+				"etherwake_nfqueue_%s_bucket{le=\"%.12g\"} %lu\n",
+				h->name, (double)(1ull << shift) / 1e9,
+				(unsigned long)cumulative);
+		}
+		fprintf(stream, "etherwake_nfqueue_%s_bucket{le=\"+Inf\"} %lu\n",
+			h->name, (unsigned long)__atomic_load_n(&h->count,
+							       __ATOMIC_RELAXED));
+		fprintf(stream, "etherwake_nfqueue_%s_sum %.9f\n", h->name,
+			__atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+		fprintf(stream, "etherwake_nfqueue_%s_count %lu\n", h->name,
+			(unsigned long)__atomic_load_n(&h->count,
+						       __ATOMIC_RELAXED));
+	}
+}
+
+void metrics_write_counter(FILE *stream, const char *name, const char *help,
+			   unsigned long value)
+{
+	fprintf(stream, "# HELP etherwake_nfqueue_%s %s.\n", name, help);
+	fprintf(stream, "# TYPE etherwake_nfqueue_%s counter\n", name);
+	fprintf(stream, "etherwake_nfqueue_%s %lu\n", name, value);
+}
+
+void metrics_write_gauge(FILE *stream, const char *name, const char *help,
+			 unsigned long value)
+{
+	fprintf(stream, "# HELP etherwake_nfqueue_%s %s.\n", name, help);
+	fprintf(stream, "# TYPE etherwake_nfqueue_%s gauge\n", name);
+	fprintf(stream, "etherwake_nfqueue_%s %lu\n", name, value);
+}
+
+/* Replace the file at once, so it is never read half written */
+static void write_export()
+{
+	char tmp_path[4096];
+	FILE *stream;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", export_path);
+	stream = fopen(tmp_path, "w");
+	if (stream == NULL) {
+		perror(tmp_path);
+		return;
+	}
+	export_write(stream);
+	if (fclose(stream) != 0 || rename(tmp_path, export_path) != 0) {
+		perror(export_path);
+		unlink(tmp_path);
+	}
+}
+
+static void *export_main(void *data)
+{
+	struct timespec next;
+
+	(void)data;
+
+	pthread_mutex_lock(&export_lock);
+	clock_gettime(CLOCK_REALTIME, &next);
+	while (!export_stopping) {
+		pthread_mutex_unlock(&export_lock);
+		write_export();
+		pthread_mutex_lock(&export_lock);
+
+		next.tv_sec += export_interval_s;
+		while (!export_stopping &&
+		       pthread_cond_timedwait(&export_cond, &export_lock,
+					      &next) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&export_lock);
+
+	/* Final state on exit */
+	write_export();
+	return NULL;
+}
+
+/* Rewrite PATH every INTERVAL_S seconds with what WRITE prints */
+int metrics_start_export(const char *path, unsigned int interval_s,
+			 void (*write)(FILE *stream))
+{
+	sigset_t all, old;
+	int ret;
+
+	export_path = path;
+	export_interval_s = interval_s;
+	export_write = write;
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&export_thread, NULL, export_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating metrics thread\n");
+		return false;
+	}
+	exporting = 1;
+	return true;
+}
+
+void metrics_stop_export()
+{
+	if (!exporting)
+		return;
+
+	pthread_mutex_lock(&export_lock);
+	export_stopping = 1;
+	pthread_cond_signal(&export_cond);
+	pthread_mutex_unlock(&export_lock);
+	pthread_join(export_thread, NULL);
+	exporting = 0;
+}
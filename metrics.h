@@ -0,0 +1,29 @@
+#ifndef ETHERWAKE_NFQUEUE_METRICS_H
+#define ETHERWAKE_NFQUEUE_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Latency histograms */
+enum {
+	METRIC_VERDICT,	/* Packet received until its verdict was sent */
+	METRIC_SEND,	/* Sending a batch of magic packets */
+	METRIC_WAKE,	/* Magic packet sent until the host responded */
+	METRIC_COUNT
+};
+
+void metrics_record(int metric, uint64_t ns);
+void metrics_record_n(int metric, uint64_t ns, uint64_t count);
+uint64_t metrics_percentile(int metric, double percentile);
+void metrics_print(FILE *stream);
+
+void metrics_write_histograms(FILE *stream);
+void metrics_write_counter(FILE *stream, const char *name, const char *help,
+			   unsigned long value);
+void metrics_write_gauge(FILE *stream, const char *name, const char *help,
+			 unsigned long value);
+int metrics_start_export(const char *path, unsigned int interval_s,
+			 void (*write)(FILE *stream));
+void metrics_stop_export();
+
+#endif //ETHERWAKE_NFQUEUE_METRICS_H
@@ -0,0 +1,540 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#include "neigh.h"
+#include "links.h"
+
+#define MAC_BUCKETS 256
+/* How often the kernel is asked to resolve a host we wait for */
+#define RESOLVE_INTERVAL_MS 1000
+
+extern int debug;
+
+/*
+ * Liveness detection from rtnetlink neighbour events: a host is online as
+ * soon as the kernel reports its MAC address as REACHABLE. While waiting,
+ * the kernel is asked to resolve the host with NTF_USE, which only causes
+ * its own ARP or neighbour solicitation traffic.
+ */
+struct neigh_host {
+	struct ether_addr eaddr;
+	int family;
+	unsigned char addr[16];
+	/* Looked up for each request, the interface may be recreated */
+	const struct link *link;
+
+	int active;
+	/* Set until the entry's current state was read */
+	int check_state;
+	uint64_t next_resolve_ms;
+	uint64_t deadline_ms;
+	uint64_t start_ms;
+	neigh_callback callback;
+	void *arg;
+
+	struct neigh_host *next;
+};
+
+struct completion {
+	struct neigh_host *host;
+	int online;
+};
+
+static struct mnl_socket *events_nl = NULL;
+static struct mnl_socket *request_nl = NULL;
+static unsigned int request_seq;
+static int event_fd = -1;
+static pthread_t thread;
+static int running = 0;
+static int stopping = 0;
+
+/* Protects hosts and their waiting state */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct neigh_host *buckets[MAC_BUCKETS];
+static unsigned int host_count = 0;
+
+/* Completions collected under the lock, called back outside of it.
+   Only the neighbour thread uses them, so it grows them as well. */
+static struct completion *done = NULL;
+static unsigned int done_size = 0;
+static unsigned int done_count = 0;
+
+static uint64_t now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int hash_mac(const unsigned char *mac)
+{
+	/* The vendor part carries little entropy */
+	return (mac[3] * 31u + mac[4] * 7u + mac[5]) % MAC_BUCKETS;
+}
+
+/* The host after HOST, or the first one without, with the MAC address */
+static struct neigh_host *lookup_mac(const unsigned char *mac,
+				     struct neigh_host *host)
+{
+	host = host ? host->next : buckets[hash_mac(mac)];
+
+	for (; host != NULL; host = host->next)
+		if (memcmp(host->eaddr.ether_addr_octet, mac, ETH_ALEN) == 0)
+			return host;
+	return NULL;
+}
+
+static void finish(struct neigh_host *host, int online)
+{
+	host->active = 0;
+	done[done_count].host = host;
+	done[done_count].online = online;
+	done_count++;
+}
+
+/* Ask the kernel to resolve the host, like sending a packet to it would */
+static void request_resolve(struct neigh_host *host)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct ndmsg *ndm;
+	int ifindex = link_ifindex(host->link);
+
+	/* Waits for the interface to come back */
+	if (ifindex == 0)
+		return;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_NEWNEIGH;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
+	ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+	ndm->ndm_family = host->family;
+	ndm->ndm_ifindex = ifindex;
+	ndm->ndm_flags = NTF_USE;
+	mnl_attr_put(nlh, NDA_DST, host->family == AF_INET6 ? 16 : 4,
+		     host->addr);
+
+	if (mnl_socket_sendto(request_nl, nlh, nlh->nlmsg_len) < 0)
+		perror("mnl_socket_sendto(RTM_NEWNEIGH)");
+}
+
+static int neigh_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, NDA_MAX) < 0)
+		return MNL_CB_OK;
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+static int neigh_event_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *tb[NDA_MAX + 1] = {};
+	struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+	struct neigh_host *host = NULL;
+	const unsigned char *lladdr;
+	char mac[18];
+
+	(void)data;
+
+	if (nlh->nlmsg_type != RTM_NEWNEIGH ||
+	    !(ndm->ndm_state & NUD_REACHABLE))
+		return MNL_CB_OK;
+
+	mnl_attr_parse(nlh, sizeof(*ndm), neigh_attr_cb, tb);
+	if (tb[NDA_LLADDR] == NULL ||
+	    mnl_attr_get_payload_len(tb[NDA_LLADDR]) != ETH_ALEN)
+		return MNL_CB_OK;
+
+	/* Hosts that changed their address share the MAC address */
+	lladdr = mnl_attr_get_payload(tb[NDA_LLADDR]);
+	while ((host = lookup_mac(lladdr, host)) != NULL) {
+		if (!host->active)
+			continue;
+		if (debug)
+			printf("Neighbour %s reachable after %lu ms\n",
+			       ether_ntoa_r(&host->eaddr, mac),
+			       (unsigned long)(now_ms() - host->start_ms));
+		finish(host, 1);
+	}
+	return MNL_CB_OK;
+}
+
+/* Tells whether the kernel's entry for HOST is REACHABLE with its MAC
+   address already.  Resolving it then causes no event. */
+static int is_reachable(struct neigh_host *host)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlattr *tb[NDA_MAX + 1] = {};
+	struct nlmsghdr *nlh;
+	struct ndmsg *ndm;
+	int ifindex = link_ifindex(host->link);
+	unsigned int seq = ++request_seq;
+	ssize_t n;
+
+	if (ifindex == 0)
+		return false;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETNEIGH;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_seq = seq;
+	ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+	ndm->ndm_family = host->family;
+	ndm->ndm_ifindex = ifindex;
+	mnl_attr_put(nlh, NDA_DST, host->family == AF_INET6 ? 16 : 4,
+		     host->addr);
+	if (mnl_socket_sendto(request_nl, nlh, nlh->nlmsg_len) < 0) {
+		perror("mnl_socket_sendto(RTM_GETNEIGH)");
+		return false;
+	}
+
+	/* The answer is queued by the time the request is sent, behind
+	   errors of earlier resolve requests */
+	while ((n = recv(mnl_socket_get_fd(request_nl), buf, sizeof(buf),
+			 MSG_DONTWAIT)) > 0) {
+		int len = n;
+
+		for (nlh = (struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, len);
+		     nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (nlh->nlmsg_seq != seq)
+				continue;
+			/* Without an entry or single lookups, e.g. before
+			   Linux 4.20, the events have to tell */
+			if (nlh->nlmsg_type != RTM_NEWNEIGH)
+				return false;
+			ndm = mnl_nlmsg_get_payload(nlh);
+			mnl_attr_parse(nlh, sizeof(*ndm), neigh_attr_cb, tb);
+			return (ndm->ndm_state & NUD_REACHABLE) &&
+				tb[NDA_LLADDR] != NULL &&
+				mnl_attr_get_payload_len(tb[NDA_LLADDR]) ==
+				ETH_ALEN &&
+				memcmp(mnl_attr_get_payload(tb[NDA_LLADDR]),
+				       host->eaddr.ether_addr_octet,
+				       ETH_ALEN) == 0;
+		}
+	}
+	return false;
+}
+
+/* Checked once per wait, before the first resolve request */
+static int reachable_already(struct neigh_host *host)
+{
+	char mac[18];
+
+	host->check_state = 0;
+	if (!is_reachable(host))
+		return false;
+	if (debug)
+		printf("Neighbour %s reachable already\n",
+		       ether_ntoa_r(&host->eaddr, mac));
+	return true;
+}
+
+static int handle_timeouts()
+{
+	uint64_t now = now_ms();
+	struct neigh_host *host;
+	int i, any_active = 0;
+
+	for (i = 0; i < MAC_BUCKETS; i++) {
+		for (host = buckets[i]; host != NULL; host = host->next) {
+			if (!host->active)
+				continue;
+			if (host->check_state && reachable_already(host)) {
+				finish(host, 1);
+				continue;
+			}
+			if (now >= host->deadline_ms) {
+				finish(host, 0);
+				continue;
+			}
+			if (now >= host->next_resolve_ms) {
+				request_resolve(host);
+				host->next_resolve_ms = now + RESOLVE_INTERVAL_MS;
+			}
+			any_active = 1;
+		}
+	}
+	return any_active;
+}
+
+static void *neigh_thread(void *data)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct pollfd fds[2];
+	uint64_t value;
+	unsigned int i;
+	int any_active = 0;
+	ssize_t n;
+
+	(void)data;
+
+	fds[0].fd = mnl_socket_get_fd(events_nl);
+	fds[0].events = POLLIN;
+	fds[1].fd = event_fd;
+	fds[1].events = POLLIN;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (poll(fds, 2, any_active ? RESOLVE_INTERVAL_MS / 4 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		pthread_mutex_lock(&lock);
+		done_count = 0;
+		if (done_size < host_count) {
+			struct completion *grown;
+
+			grown = realloc(done, host_count * sizeof(*done));
+			if (grown == NULL) {
+				pthread_mutex_unlock(&lock);
+				perror("realloc");
+				continue;
+			}
+			done = grown;
+			done_size = host_count;
+		}
+
+		if (fds[1].revents & POLLIN &&
+		    read(event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			perror("read(eventfd)");
+
+		while (fds[0].revents & POLLIN) {
+			n = recv(fds[0].fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (n < 0) {
+				/* Missed events on a busy LAN are not fatal */
+				if (errno != EAGAIN && errno != ENOBUFS)
+					perror("recv(neighbour events)");
+				if (errno != ENOBUFS)
+					break;
+				continue;
+			}
+			mnl_cb_run(buf, n, 0, 0, neigh_event_cb, NULL);
+		}
+
+		any_active = handle_timeouts();
+		pthread_mutex_unlock(&lock);
+
+		/* Callbacks may start waiting again */
+		for (i = 0; i < done_count; i++)
+			done[i].host->callback(done[i].host, done[i].online,
+					       done[i].host->arg);
+	}
+
+	return NULL;
+}
+
+int setup_neigh()
+{
+	sigset_t all, old;
+	int ret;
+
+	if (running)
+		return true;
+
+	events_nl = mnl_socket_open(NETLINK_ROUTE);
+	request_nl = mnl_socket_open(NETLINK_ROUTE);
+	if (events_nl == NULL || request_nl == NULL) {
+		fprintf(stderr, "mnl_socket_open() failed\n");
+		return false;
+	}
+
+	if (mnl_socket_bind(events_nl, RTMGRP_NEIGH, MNL_SOCKET_AUTOPID) < 0 ||
+	    mnl_socket_bind(request_nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		fprintf(stderr, "mnl_socket_bind() failed\n");
+		return false;
+	}
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0) {
+		perror("eventfd");
+		return false;
+	}
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, neigh_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating neighbour thread\n");
+		return false;
+	}
+	running = 1;
+
+	return true;
+}
+
+struct neigh_host *neigh_add_host(const struct ether_addr *eaddr, int family,
+				  const void *addr, const struct link *link)
+{
+	struct neigh_host *host = NULL;
+	unsigned int b;
+
+	/* A replaced target keeps waiting on the same host */
+	pthread_mutex_lock(&lock);
+	while ((host = lookup_mac(eaddr->ether_addr_octet, host)) != NULL)
+		if (host->family == family && host->link == link &&
+		    memcmp(host->addr, addr, family == AF_INET6 ? 16 : 4) == 0)
+			break;
+	pthread_mutex_unlock(&lock);
+	if (host != NULL)
+		return host;
+
+	host = calloc(1, sizeof(*host));
+	if (host == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	host->eaddr = *eaddr;
+	host->family = family;
+	memcpy(host->addr, addr, family == AF_INET6 ? 16 : 4);
+	host->link = link;
+
+	pthread_mutex_lock(&lock);
+	b = hash_mac(eaddr->ether_addr_octet);
+	host->next = buckets[b];
+	buckets[b] = host;
+	host_count++;
+	pthread_mutex_unlock(&lock);
+
+	return host;
+}
+
+/* Wait for HOST to become reachable for at most TIMEOUT_MS, then run
+   CALLBACK in the neighbour thread.  One that is reachable already is
+   done right away.  Returns false when already waiting. */
+int neigh_start(struct neigh_host *host, unsigned int timeout_ms,
+		neigh_callback callback, void *arg)
+{
+	uint64_t one = 1, now = now_ms();
+
+	pthread_mutex_lock(&lock);
+	if (host->active) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	host->active = 1;
+	host->check_state = 1;
+	host->callback = callback;
+	host->arg = arg;
+	host->start_ms = now;
+	host->next_resolve_ms = now;
+	host->deadline_ms = now + timeout_ms;
+	pthread_mutex_unlock(&lock);
+
+	if (write(event_fd, &one, sizeof(one)) < 0)
+		perror("write(eventfd)");
+	return true;
+}
+
+struct waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	int online;
+};
+
+static void wake_waiter(struct neigh_host *host, int online, void *arg)
+{
+	struct waiter *waiter = arg;
+
+	(void)host;
+	pthread_mutex_lock(&waiter->lock);
+	waiter->done = 1;
+	waiter->online = online;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->lock);
+}
+
+/* Blocking variant of neigh_start(), returns true when HOST is reachable */
+int neigh_wait(struct neigh_host *host, unsigned int timeout_ms)
+{
+	struct waiter waiter = { PTHREAD_MUTEX_INITIALIZER,
+				 PTHREAD_COND_INITIALIZER, 0, 0 };
+
+	if (!neigh_start(host, timeout_ms, wake_waiter, &waiter))
+		return false;
+
+	pthread_mutex_lock(&waiter.lock);
+	while (!waiter.done)
+		pthread_cond_wait(&waiter.cond, &waiter.lock);
+	pthread_mutex_unlock(&waiter.lock);
+
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.lock);
+	return waiter.online;
+}
+
+void cleanup_neigh()
+{
+	struct neigh_host *host, *next;
+	uint64_t one = 1;
+	int i;
+
+	if (running) {
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		if (write(event_fd, &one, sizeof(one)) < 0)
+			perror("write(eventfd)");
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+
+	for (i = 0; i < MAC_BUCKETS; i++) {
+		for (host = buckets[i]; host != NULL; host = next) {
+			next = host->next;
+			free(host);
+		}
+		buckets[i] = NULL;
+	}
+	host_count = 0;
+	free(done);
+	done = NULL;
+	done_size = 0;
+
+	if (event_fd >= 0)
+		close(event_fd);
+	event_fd = -1;
+	if (events_nl != NULL)
+		mnl_socket_close(events_nl);
+	if (request_nl != NULL)
+		mnl_socket_close(request_nl);
+	events_nl = request_nl = NULL;
+}
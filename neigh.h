@@ -0,0 +1,21 @@
+#ifndef ETHERWAKE_NFQUEUE_NEIGH_H
+#define ETHERWAKE_NFQUEUE_NEIGH_H
+
+#include <netinet/ether.h>
+
+struct link;
+
+struct neigh_host;
+
+typedef void (*neigh_callback)(struct neigh_host *host, int online,
+			       void *arg);
+
+int setup_neigh();
+struct neigh_host *neigh_add_host(const struct ether_addr *eaddr, int family,
+				  const void *addr, const struct link *link);
+int neigh_start(struct neigh_host *host, unsigned int timeout_ms,
+		neigh_callback callback, void *arg);
+int neigh_wait(struct neigh_host *host, unsigned int timeout_ms);
+void cleanup_neigh();
+
+#endif //ETHERWAKE_NFQUEUE_NEIGH_H
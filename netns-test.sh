@@ -0,0 +1,107 @@
+#!/bin/sh
+# End-to-end check in network namespaces, as described in "Testing with
+# network namespaces" in README.md: a client connects through a router
+# running etherwake-nfqueue, without and with '-d', to a host that drops
+# everything until it saw a magic packet.  Prints the latencies of both
+# and fails unless '-d' spares the SYN retransmission.  Needs root, ip,
+# iptables and python3.
+#
+# usage: netns-test.sh [<path to etherwake-nfqueue>]
+
+EW=${1:-etherwake-nfqueue}
+NS=ewtest$$
+# How long the sleeping host takes to "boot" after the magic packet
+BOOT_S=2
+pids=
+
+skip() { echo "SKIP: $*"; exit 77; }
+fail() { echo "FAIL: $*"; exit 1; }
+
+for tool in ip iptables python3; do
+	command -v $tool >/dev/null || skip "$tool not found"
+done
+[ "$(id -u)" = 0 ] || skip "needs root"
+
+cleanup() {
+	[ -n "$pids" ] && kill $pids 2>/dev/null
+	rm -rf "$tmp"
+	for ns in client router target; do
+		ip netns del $NS-$ns 2>/dev/null
+	done
+}
+trap cleanup EXIT
+tmp=$(mktemp -d) || fail "mktemp"
+
+for ns in client router target; do ip netns add $NS-$ns || fail "netns"; done
+ip link add c0 netns $NS-client type veth peer name r0 netns $NS-router
+ip link add t0 netns $NS-target type veth peer name r1 netns $NS-router
+ip -n $NS-client addr add 10.0.1.2/24 dev c0
+ip -n $NS-router addr add 10.0.1.1/24 dev r0
+ip -n $NS-router addr add 10.0.2.1/24 dev r1
+ip -n $NS-target addr add 10.0.2.2/24 dev t0
+for l in client:c0 router:r0 router:r1 target:t0 client:lo router:lo target:lo; do
+	ip -n $NS-${l%:*} link set ${l#*:} up || fail "link ${l#*:}"
+done
+ip -n $NS-client route add default via 10.0.1.1
+ip -n $NS-target route add default via 10.0.2.1
+ip netns exec $NS-router sysctl -qw net.ipv4.ip_forward=1
+ip netns exec $NS-router iptables -I FORWARD -p tcp --syn -d 10.0.2.2 \
+	-j NFQUEUE --queue-num 0 --queue-bypass || fail "iptables in router"
+
+mac=$(ip -n $NS-target -br link show t0 | awk '{ print $3 }')
+ip netns exec $NS-target python3 -m http.server --bind 10.0.2.2 8000 \
+	>/dev/null 2>&1 &
+pids="$pids $!"
+
+# Puts the target to sleep, runs the daemon with the options given and
+# connects.  Prints when the SYN went out and how long after it the
+# magic packet and the first reply came, which is left in $reply_s.
+run() {
+	options=${*:-no options}
+	ip netns exec $NS-target iptables -I INPUT -j DROP ||
+		fail "iptables in target"
+	# The magic packet arrives at the packet socket before netfilter
+	(
+		ip netns exec $NS-target python3 -c '
+import socket, time
+s = socket.socket(socket.AF_PACKET, socket.SOCK_RAW, socket.htons(0x0842))
+s.settimeout(25)
+s.recv(2048)
+print("%.3f" % time.time())' > $tmp/magic &&
+		sleep $BOOT_S &&
+		ip netns exec $NS-target iptables -D INPUT -j DROP
+	) &
+	waiter=$!
+	pids="$pids $waiter"
+	ip netns exec $NS-router "$EW" -v -i r1 -q 0 "$@" $mac \
+		> $tmp/daemon.log 2>&1 &
+	daemon=$!
+	pids="$pids $daemon"
+	sleep 1
+
+	ip netns exec $NS-client python3 -c '
+import socket, time
+syn = time.time()
+socket.create_connection(("10.0.2.2", 8000), timeout=20).close()
+print("%.3f %.3f" % (syn, time.time()))' > $tmp/client ||
+		fail "no connection with $options"
+	kill $daemon
+	wait $waiter || fail "no magic packet with $options"
+
+	read syn reply < $tmp/client
+	read magic < $tmp/magic
+	reply_s=$(awk "BEGIN { print $reply - $syn }")
+	printf "%-12s SYN at %s, magic packet %+.3f s, first reply %+.3f s\n" \
+		"$options:" $syn $(awk "BEGIN { print $magic - $syn }") \
+		$reply_s
+}
+
+run
+# The SYN is held until the target answers a ping, so the reply follows
+# the boot time by at most a ping interval, where a retransmitted SYN
+# would only get through after 3 s
+run -d 10.0.2.2
+awk "BEGIN { exit !($reply_s < $BOOT_S + 0.9) }" ||
+	fail "the reply with -d took too long"
+
+echo "PASS"
@@ -0,0 +1,474 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures the receive and verdict path of nfqueue.c without the kernel.
+ * Each queue gets a socketpair instead of a netlink socket, and a feeder
+ * writes NFQNL_MSG_PACKET messages to it as fast as verdicts come back.
+ */
+
+#define _GNU_SOURCE /* pthread_sigmask() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+
+#include <linux/types.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "nfqueue.h"
+#include "metrics.h"
+
+#define MAX_QUEUES 64
+#define BUFFER_SIZE 65536
+#define MAX_PAYLOAD 1500
+/* What the receive loop takes in one datagram, see BUFFER_SIZE there */
+#define MAX_DATAGRAM ((size_t)(0xFF + MNL_SOCKET_BUFFER_SIZE / 2))
+
+int debug = 0;
+int verbose = 1;
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t report_requested = 0;
+
+static const char usage_msg[] =
+"usage: nfqueue-bench [-O] [-n packets] [-b packets] [-q queues] [-s bytes]\n"
+"\n"
+"	-n packets	Packets to send through each queue (default 1000000).\n"
+"	-b packets	Packets per datagram (default 1, as sent by the kernel).\n"
+"	-q queues	Number of queues, each with its own thread (default 1).\n"
+"	-s bytes	Payload copied with each packet (default 40).\n"
+"	-O		Shed load while falling behind, as with etherwake-nfqueue -O.\n";
+
+static unsigned long opt_packets = 1000000;
+static unsigned long opt_batch = 1;
+static unsigned long opt_queues = 1;
+static unsigned long opt_payload = 40;
+static int opt_overload = 0;
+
+/* The far end of a queue's socketpair, standing in for the kernel */
+struct feeder {
+	uint16_t queue_num;
+	int fds[2];
+	pthread_t writer;
+	pthread_t reader;
+	/* Posted once the queue is configured */
+	sem_t configured;
+	/* Send time of each packet id, replaced by its latency */
+	uint64_t *stamps;
+	/* Set for each packet id with a verdict, and how many are set */
+	unsigned char *answered;
+	uint32_t answered_count;
+	/* All ids up to this one have a verdict */
+	uint32_t done;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+static struct feeder feeders[MAX_QUEUES];
+static unsigned int feeder_count;
+static unsigned int feeders_done;
+static pthread_t main_thread;
+/* Keeps the packet callback from being optimized out */
+static volatile unsigned char last_host;
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t put_packet(char *buf, uint16_t queue_num, uint32_t id)
+{
+	struct nfqnl_msg_packet_hdr hdr;
+	unsigned char payload[MAX_PAYLOAD];
+	struct nlmsghdr *nlh;
+
+	/* An IPv4 header towards 192.168.0.<id> */
+	memset(payload, 0, opt_payload);
+	payload[0] = 0x45;
+	payload[9] = IPPROTO_TCP;
+	payload[16] = 192;
+	payload[17] = 168;
+	payload[19] = id & 0xFF;
+
+	hdr.packet_id = htonl(id);
+	hdr.hw_protocol = htons(0x0800);
+	hdr.hook = NF_INET_FORWARD;
+
+	nlh = nfq_nlmsg_put(buf, NFQNL_MSG_PACKET, queue_num);
+	mnl_attr_put(nlh, NFQA_PACKET_HDR, sizeof(hdr), &hdr);
+	if (opt_payload)
+		mnl_attr_put(nlh, NFQA_PAYLOAD, opt_payload, payload);
+	return NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static void *writer_thread(void *data)
+{
+	struct feeder *f = data;
+	char *buf;
+	uint32_t id = 1, i;
+	size_t len;
+
+	buf = malloc(BUFFER_SIZE);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	sem_wait(&f->configured);
+	f->start_ns = now_ns();
+
+	while (id <= opt_packets) {
+		len = 0;
+		for (i = 0; i < opt_batch && id <= opt_packets; i++, id++) {
+			f->stamps[id] = now_ns();
+			len += put_packet(buf + len, f->queue_num, id);
+		}
+		if (send(f->fds[1], buf, len, 0) < 0) {
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void answer(struct feeder *f, uint32_t id, uint64_t now)
+{
+	if (f->answered[id])
+		return;
+	f->answered[id] = 1;
+	f->answered_count++;
+	f->stamps[id] = now - f->stamps[id];
+}
+
+/* Single verdicts may come out of order, e.g. for parked packets */
+static void verdict_received(struct feeder *f, int type, uint32_t id,
+			     uint64_t now)
+{
+	uint32_t i;
+
+	if (id == 0 || id > opt_packets)
+		return;
+
+	if (type == NFQNL_MSG_VERDICT_BATCH) {
+		for (i = f->done + 1; i <= id; i++)
+			answer(f, i, now);
+	} else {
+		answer(f, id, now);
+	}
+	while (f->done < opt_packets && f->answered[f->done + 1])
+		f->done++;
+}
+
+/* Collect the verdicts, the first datagrams configure the queue */
+static void *reader_thread(void *data)
+{
+	struct feeder *f = data;
+	unsigned int i;
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(BUFFER_SIZE);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	while (f->answered_count < opt_packets) {
+		struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		uint64_t now;
+		int len;
+
+		n = recv(f->fds[1], buf, BUFFER_SIZE, 0);
+		if (n <= 0) {
+			if (n < 0)
+				perror("recv");
+			break;
+		}
+		now = now_ns();
+
+		for (len = n; mnl_nlmsg_ok(nlh, len);
+		     nlh = mnl_nlmsg_next(nlh, &len)) {
+			struct nlattr *attr;
+			int type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+
+			mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+				const struct nfqnl_msg_verdict_hdr *hdr;
+
+				if (type == NFQNL_MSG_CONFIG &&
+				    mnl_attr_get_type(attr) == NFQA_CFG_PARAMS)
+					sem_post(&f->configured);
+				if (type == NFQNL_MSG_CONFIG ||
+				    mnl_attr_get_type(attr) != NFQA_VERDICT_HDR)
+					continue;
+				hdr = mnl_attr_get_payload(attr);
+				verdict_received(f, type, ntohl(hdr->id), now);
+			}
+		}
+	}
+	f->end_ns = now_ns();
+
+	/* The last queue to finish ends the receive loops */
+	if (__atomic_add_fetch(&feeders_done, 1, __ATOMIC_ACQ_REL) ==
+	    feeder_count) {
+		stop_requested = 1;
+		for (i = 0; i < feeder_count; i++)
+			shutdown(feeders[i].fds[1], SHUT_RDWR);
+		pthread_kill(main_thread, SIGUSR2);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *feeder_open(uint16_t queue_num)
+{
+	struct feeder *f = &feeders[feeder_count];
+	sigset_t block, old;
+
+	if (feeder_count == MAX_QUEUES)
+		return NULL;
+
+	f->queue_num = queue_num;
+	f->stamps = calloc(opt_packets + 1, sizeof(*f->stamps));
+	f->answered = calloc(opt_packets + 1, sizeof(*f->answered));
+	if (f->stamps == NULL || f->answered == NULL ||
+	    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, f->fds) < 0) {
+		perror(f->stamps && f->answered ? "socketpair" : "calloc");
+		free(f->stamps);
+		free(f->answered);
+		f->stamps = NULL;
+		f->answered = NULL;
+		return NULL;
+	}
+	sem_init(&f->configured, 0, 0);
+
+	/* Signals are meant for the receive loops */
+	sigfillset(&block);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	if (pthread_create(&f->writer, NULL, writer_thread, f) != 0 ||
+	    pthread_create(&f->reader, NULL, reader_thread, f) != 0) {
+		fprintf(stderr, "Failed creating feeder threads\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	feeder_count++;
+	return f;
+}
+
+static int feeder_get_fd(void *sock)
+{
+	return ((struct feeder *)sock)->fds[0];
+}
+
+static unsigned int feeder_get_portid(void *sock)
+{
+	(void)sock;
+	return 0;
+}
+
+static ssize_t feeder_send(void *sock, const void *buf, size_t len)
+{
+	return send(((struct feeder *)sock)->fds[0], buf, len, 0);
+}
+
+static void feeder_close(void *sock)
+{
+	struct feeder *f = sock;
+
+	/* Lets the feeder threads go if the queue wasn't set up */
+	shutdown(f->fds[0], SHUT_RDWR);
+	sem_post(&f->configured);
+	pthread_join(f->writer, NULL);
+	pthread_join(f->reader, NULL);
+	close(f->fds[0]);
+	close(f->fds[1]);
+}
+
+static const struct nfqueue_transport feeder_transport = {
+	.open = feeder_open,
+	.get_fd = feeder_get_fd,
+	.get_portid = feeder_get_portid,
+	.send = feeder_send,
+	.close = feeder_close,
+};
+
+/* What ether-wake does with -m: look at the destination address */
+static int handle_packet(struct nfqueue_packet *packet)
+{
+	if (packet->len >= 20)
+		last_host = packet->payload[19];
+	return NFQUEUE_ACCEPT;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Called from nfqueue_print_stats() at the end of the run */
+static void print_results(FILE *stream)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	struct nfqueue_stats stats;
+	uint64_t *latencies, start = UINT64_MAX, end = 0;
+	size_t i, count = 0;
+	uint32_t id;
+
+	nfqueue_get_stats(&stats);
+	if (stats.packets == 0)
+		return;
+
+	latencies = malloc(feeder_count * opt_packets * sizeof(*latencies));
+	if (latencies == NULL) {
+		perror("malloc");
+		return;
+	}
+	for (i = 0; i < feeder_count; i++) {
+		struct feeder *f = &feeders[i];
+
+		for (id = 1; id <= opt_packets; id++)
+			if (f->answered[id])
+				latencies[count++] = f->stamps[id];
+		if (f->start_ns < start)
+			start = f->start_ns;
+		if (f->end_ns > end)
+			end = f->end_ns;
+	}
+	/* Shedding load or stopping early may leave none */
+	if (count == 0) {
+		fprintf(stream, "No verdicts received\n");
+		free(latencies);
+		return;
+	}
+	qsort(latencies, count, sizeof(*latencies), compare_u64);
+
+	fprintf(stream, "%zu packets through %u queues in %.3f s: "
+		"%.0f packets/s, %.3f syscalls per packet\n", count,
+		feeder_count, (end - start) / 1e9,
+		end > start ? count / ((end - start) / 1e9) : 0.0,
+		(double)(stats.recv_calls + stats.verdict_msgs) / stats.packets);
+	fprintf(stream, "Packet to verdict:");
+	for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++)
+		fprintf(stream, " p%g %.1f us", percentiles[i],
+			latencies[(size_t)(count * percentiles[i] / 100)] /
+			1000.0);
+	fprintf(stream, ", max %.1f us\n", latencies[count - 1] / 1000.0);
+	metrics_print(stream);
+	free(latencies);
+}
+
+static void wakeup_handler(int signum)
+{
+	(void)signum;
+}
+
+static int get_ulong(const char *optarg, unsigned long min,
+		     unsigned long max, unsigned long *val)
+{
+	char *endptr;
+
+	errno = 0;
+	*val = strtoul(optarg, &endptr, 10);
+
+	if (errno != 0 || *val < min || *val > max || endptr == optarg ||
+	    *endptr != '\0') {
+		fprintf(stderr, "Invalid value %s\n", optarg);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct nfqueue_config config = { 0, };
+	struct sigaction action;
+	int c, errflag = 0;
+
+	while ((c = getopt(argc, argv, "b:n:Oq:s:")) != -1)
+		switch (c) {
+		case 'b':
+			errflag |= get_ulong(optarg, 1, 256, &opt_batch);
+			break;
+		case 'n':
+			errflag |= get_ulong(optarg, 1, UINT32_MAX - 1,
+					     &opt_packets);
+			break;
+		case 'O':
+			opt_overload = 1;
+			break;
+		case 'q':
+			errflag |= get_ulong(optarg, 1, MAX_QUEUES,
+					     &opt_queues);
+			break;
+		case 's':
+			errflag |= get_ulong(optarg, 0, MAX_PAYLOAD,
+					     &opt_payload);
+			break;
+		default:
+			errflag = -1;
+		}
+	if (errflag || optind != argc) {
+		fprintf(stderr, "%s", usage_msg);
+		return 3;
+	}
+	if (opt_batch * (size_t)(NLMSG_HDRLEN + sizeof(struct nfgenmsg) +
+			 MNL_ALIGN(sizeof(struct nlattr) +
+				   sizeof(struct nfqnl_msg_packet_hdr)) +
+			 MNL_ALIGN(sizeof(struct nlattr) + opt_payload)) >
+	    MAX_DATAGRAM) {
+		fprintf(stderr, "%lu packets of %lu bytes don't fit into a "
+			"datagram\n", opt_batch, opt_payload);
+		return 3;
+	}
+
+	/* Interrupts the wait for the receive threads once all are done */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = wakeup_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR2, &action, NULL);
+	main_thread = pthread_self();
+
+	config.queue_count = opt_queues;
+	config.copy_range = opt_payload;
+	config.overload = opt_overload;
+	config.report = &print_results;
+	config.transport = &feeder_transport;
+
+	return nfqueue_receive(&config, &handle_packet);
+}
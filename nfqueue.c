@@ -13,135 +13,951 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE /* recvmmsg(), CPU affinity */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nfnetlink.h>
 
 #include <linux/netfilter/nfnetlink_queue.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
 
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
 #include "nfqueue.h"
+#include "metrics.h"
 
 #define BUFFER_SIZE (0xFF + MNL_SOCKET_BUFFER_SIZE / 2)
+/* Large enough for a verdict message with all its attributes, including
+   the marks */
+#define VERDICT_MSG_SIZE 128
+/* Accepted packets collected before a verdict is sent */
+#define MAX_BATCH 64
+/* Packets parked per queue, more are accepted right away */
+#define MAX_PARKED 1024
+/* Callbacks deferred until after the verdict in async mode */
+#define MAX_DEFERRED MAX_BATCH
+/* Netlink datagrams drained with a single recvmmsg() */
+#define RECV_VLEN 8
+/* Receive passes in a row that fill all of RECV_VLEN before the queue
+   counts as falling behind */
+#define PRESSURE_PASSES 4
+/* Load is shed for this long after the last sign of pressure */
+#define SHED_HOLD_NS 1000000000ULL
+
+#define PROC_QUEUE_STATS "/proc/net/netfilter/nfnetlink_queue"
+
+/* Stats are written by one receive thread each and read by others */
+#define STAT_ADD(ctx, field, n)                                        \
+	__atomic_store_n(&(ctx)->stats.field, (ctx)->stats.field + (n), \
+			 __ATOMIC_RELAXED)
 
 extern int debug;
+extern int verbose;
+extern volatile sig_atomic_t stop_requested;
+extern volatile sig_atomic_t report_requested;
+
+struct parked_packet {
+	uint32_t id;
+	void *key;
+	int mark_flow;
+	uint32_t mark;
+	uint64_t deadline;
+	uint64_t received_ns;
+};
+
+/* Everything a receive thread needs for the queue it is bound to */
+struct queue_context {
+	const struct nfqueue_config *config;
+	nfqueue_callback callback;
+	uint16_t queue_num;
+	int cpu;
+	pthread_t thread;
+	int ret;
+
+	const struct nfqueue_transport *transport;
+	void *sock;
+	int fd;
+	uint16_t portid;
 
-static int recv_callback(const struct nlmsghdr *nlh, void *data);
+	/*
+	 * Packets received in one recvmmsg() call are accepted together with
+	 * a single NFQNL_MSG_VERDICT_BATCH message up to the highest packet id.
+	 * While packets are parked, the batch must stay below the oldest one
+	 * and younger packets get their own verdict message in the same
+	 * datagram.
+	 */
+	char verdict_buf[MAX_BATCH * VERDICT_MSG_SIZE];
+	uint32_t batch_ids[MAX_BATCH];
+	unsigned int batch_count;
+	/* Packets accepted with the flow mark need their own verdict, sent
+	   ahead of the batch so it doesn't cover them.  Their ids and
+	   packet marks as queued. */
+	uint32_t marked_ids[MAX_BATCH];
+	uint32_t marked_marks[MAX_BATCH];
+	unsigned int marked_count;
+	/* When the packets of the current receive pass arrived */
+	uint64_t received_ns;
+
+	struct nfqueue_packet deferred[MAX_DEFERRED];
+	unsigned int deferred_count;
+
+	/* Parked packets in arrival order */
+	struct parked_packet *parked;
+	unsigned int parked_count;
+	/* Signalled by nfqueue_notify() */
+	int event_fd;
+
+	/* Load shedding with config->overload, see update_pressure() */
+	unsigned int full_passes;
+	uint64_t shed_until_ns;
+	int shedding;
+
+	struct nfqueue_stats stats;
+};
 
-static struct mnl_socket *nl;
+static int recv_callback(const struct nlmsghdr *nlh, void *data);
+static void update_pressure(struct queue_context *ctx, int n);
+static int flush_verdicts(struct queue_context *ctx);
+static int receive_loop(struct queue_context *ctx);
+static int wait_parked(struct queue_context *ctx);
 
-int nfqueue_receive(uint16_t queue_num, int (*callback)())
+static void *netlink_open(uint16_t queue_num)
 {
-	uint16_t portid;
+	struct mnl_socket *nl;
 
-	char buf[BUFFER_SIZE];
-	struct nlmsghdr *nlh;
-
-	if (debug)
-		puts("Setting up netlink socket");
+	(void)queue_num;
 
-	// Create socket
 	nl = mnl_socket_open(NETLINK_NETFILTER);
 	if (nl == NULL) {
 		fprintf(stderr, "mnl_socket_open() failed\n");
-		return EXIT_FAILURE;
+		return NULL;
 	}
 
 	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
 		fprintf(stderr, "mnl_socket_bind() failed\n");
-		return EXIT_FAILURE;
+		mnl_socket_close(nl);
+		return NULL;
 	}
 
-	portid = mnl_socket_get_portid(nl);
+	return nl;
+}
+
+static int netlink_get_fd(void *sock)
+{
+	return mnl_socket_get_fd(sock);
+}
+
+static unsigned int netlink_get_portid(void *sock)
+{
+	return mnl_socket_get_portid(sock);
+}
+
+static ssize_t netlink_send(void *sock, const void *buf, size_t len)
+{
+	return mnl_socket_sendto(sock, buf, len);
+}
+
+static void netlink_close(void *sock)
+{
+	mnl_socket_close(sock);
+}
+
+static const struct nfqueue_transport netlink_transport = {
+	.open = netlink_open,
+	.get_fd = netlink_get_fd,
+	.get_portid = netlink_get_portid,
+	.send = netlink_send,
+	.close = netlink_close,
+};
+
+static struct queue_context *contexts;
+static unsigned int context_count = 0;
+/* Keeps nfqueue_get_stats() and nfqueue_notify() from other threads off
+   freed contexts and closed event descriptors */
+static pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec start_time;
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t now_ms()
+{
+	return now_ns() / 1000000;
+}
+
+static int set_receive_buffer(struct queue_context *ctx, int size)
+{
+	int fd = ctx->fd;
+
+	/* SO_RCVBUFFORCE ignores rmem_max but needs CAP_NET_ADMIN */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) <
+		    0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+		perror("setsockopt: SO_RCVBUF");
+		return -1;
+	}
+
+	if (debug) {
+		socklen_t len = sizeof(size);
+		if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+			printf("Netlink receive buffer is %d bytes\n", size);
+	}
+	return 0;
+}
+
+static int setup_queue(struct queue_context *ctx)
+{
+	const struct nfqueue_config *config = ctx->config;
+	uint16_t queue_num = ctx->queue_num;
+
+	char buf[BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	int fd;
+
+	if (debug)
+		printf("Setting up netlink socket for queue %u\n", queue_num);
+
+	// Create socket
+	ctx->sock = ctx->transport->open(queue_num);
+	if (ctx->sock == NULL)
+		return -1;
+
+	ctx->fd = ctx->transport->get_fd(ctx->sock);
+	ctx->portid = ctx->transport->get_portid(ctx->sock);
 
 	// Configure socket
 	nlh = nfq_nlmsg_put(buf, NFQNL_MSG_CONFIG, queue_num);
-	nfq_nlmsg_cfg_put_cmd(nlh, AF_INET, NFQNL_CFG_CMD_BIND);
-	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
-		fprintf(stderr, "Failed binding socket to queue\n");
-		return EXIT_FAILURE;
+	/* Since Linux 3.8 the family is ignored, the queue gets IPv4 and IPv6
+	   packets alike */
+	nfq_nlmsg_cfg_put_cmd(nlh, AF_UNSPEC, NFQNL_CFG_CMD_BIND);
+	if (ctx->transport->send(ctx->sock, nlh, nlh->nlmsg_len) < 0) {
+		fprintf(stderr, "Failed binding socket to queue %u\n", queue_num);
+		return -1;
 	}
 
 	nlh = nfq_nlmsg_put(buf, NFQNL_MSG_CONFIG, queue_num);
-	nfq_nlmsg_cfg_put_params(nlh, NFQNL_COPY_META, 0xFF);
+	if (config->copy_range)
+		nfq_nlmsg_cfg_put_params(nlh, NFQNL_COPY_PACKET,
+					 config->copy_range);
+	else
+		nfq_nlmsg_cfg_put_params(nlh, NFQNL_COPY_META, 0xFF);
 	mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_FAIL_OPEN));
 	mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_FAIL_OPEN));
-	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+	if (config->queue_maxlen)
+		mnl_attr_put_u32(nlh, NFQA_CFG_QUEUE_MAXLEN,
+				 htonl(config->queue_maxlen));
+	if (ctx->transport->send(ctx->sock, nlh, nlh->nlmsg_len) < 0) {
 		fprintf(stderr, "Failed setting queue configuration\n");
-		return EXIT_FAILURE;
+		return -1;
 	}
 
 	/* ENOBUFS is signalled to userspace when packets were lost
-	 * on kernel side.  In most cases, userspace isn't interested
-	 * in this information, so turn it off.
+	 * on kernel side.  Unless asked to watch for overload, userspace
+	 * isn't interested in this information, so turn it off.
 	 */
-	ssize_t ret = 1;
-	mnl_socket_setsockopt(nl, NETLINK_NO_ENOBUFS, &ret, sizeof(int));
+	int one = 1;
+	if (!config->overload)
+		setsockopt(ctx->fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, &one,
+			   sizeof(int));
+
+	if (config->rcvbuf > 0 && set_receive_buffer(ctx, config->rcvbuf) < 0)
+		return -1;
+
+	if (config->park_timeout_ms) {
+		ctx->parked = calloc(MAX_PARKED, sizeof(*ctx->parked));
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		pthread_mutex_lock(&contexts_lock);
+		ctx->event_fd = fd;
+		pthread_mutex_unlock(&contexts_lock);
+		if (ctx->parked == NULL || ctx->event_fd < 0) {
+			perror("Failed setting up parking");
+			return -1;
+		}
+	}
 
-	if (debug)
-		puts("Listening for packages");
+	return 0;
+}
+
+static void *queue_thread(void *data)
+{
+	struct queue_context *ctx = data;
+	cpu_set_t cpus;
+
+	/* With --queue-cpu-fanout, queue N receives packets from CPU N */
+	CPU_ZERO(&cpus);
+	CPU_SET(ctx->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		fprintf(stderr, "Failed pinning queue %u to CPU %d\n",
+			ctx->queue_num, ctx->cpu);
+	else if (debug)
+		printf("Queue %u pinned to CPU %d\n", ctx->queue_num, ctx->cpu);
+
+	ctx->ret = receive_loop(ctx);
+
+	/* Make the main thread notice when a receive thread failed */
+	if (ctx->ret != EXIT_SUCCESS && !stop_requested) {
+		stop_requested = 1;
+		kill(getpid(), SIGTERM);
+	}
+	return NULL;
+}
 
-	for (;;) {
-		ret = mnl_socket_recvfrom(nl, buf, BUFFER_SIZE);
-		if (ret == -1) {
-			fprintf(stderr, "mnl_socket_recvfrom\n");
-			return (EXIT_FAILURE);
+static void wakeup_handler(int signum)
+{
+	(void)signum;
+}
+
+/* Wait for a signal in the main thread while the receive threads run */
+static int run_threads()
+{
+	struct sigaction action;
+	sigset_t block, old;
+	unsigned int i;
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int ret = EXIT_SUCCESS;
+
+	if (cpu_count < 1)
+		cpu_count = 1;
+
+	/* SIGUSR2 only interrupts blocking receives on shutdown */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = wakeup_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR2, &action, NULL);
+
+	/* Receive threads inherit the mask and leave signals to us */
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+
+	for (i = 0; i < context_count; i++) {
+		contexts[i].cpu = i % cpu_count;
+		if (pthread_create(&contexts[i].thread, NULL, queue_thread,
+				   &contexts[i]) != 0) {
+			fprintf(stderr, "Failed creating thread for queue %u\n",
+				contexts[i].queue_num);
+			stop_requested = 1;
+			break;
 		}
+	}
 
-		ret = mnl_cb_run(buf, ret, 0, portid, recv_callback, callback);
-		if (ret < 0) {
-			fprintf(stderr, "mnl_cb_run\n");
-			return (EXIT_FAILURE);
+	while (!stop_requested) {
+		sigsuspend(&old);
+		if (report_requested) {
+			report_requested = 0;
+			nfqueue_print_stats(stdout);
 		}
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-	mnl_socket_close(nl);
-	return 0;
+	while (i-- > 0) {
+		while (pthread_tryjoin_np(contexts[i].thread, NULL) == EBUSY) {
+			pthread_kill(contexts[i].thread, SIGUSR2);
+			usleep(10000);
+		}
+		if (contexts[i].ret != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
+
+int nfqueue_receive(const struct nfqueue_config *config,
+		    nfqueue_callback callback)
+{
+	unsigned int i, j;
+	int ret = EXIT_SUCCESS;
+
+	i = config->queue_count ? config->queue_count : 1;
+	if (i > NFQUEUE_MAX_QUEUES ||
+	    config->queue_num + i - 1 > UINT16_MAX) {
+		fprintf(stderr, "Invalid range of %u queues from %u\n", i,
+			config->queue_num);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_lock(&contexts_lock);
+	contexts = calloc(i, sizeof(*contexts));
+	if (contexts != NULL)
+		context_count = i;
+	for (i = 0; i < context_count; i++)
+		contexts[i].event_fd = -1;
+	pthread_mutex_unlock(&contexts_lock);
+	if (contexts == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < context_count && ret == EXIT_SUCCESS; i++) {
+		contexts[i].config = config;
+		contexts[i].callback = callback;
+		contexts[i].queue_num = config->queue_num + i;
+		contexts[i].transport = config->transport ? config->transport :
+			&netlink_transport;
+		if (setup_queue(&contexts[i]) < 0)
+			ret = EXIT_FAILURE;
+	}
+
+	if (ret == EXIT_SUCCESS) {
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		if (context_count == 1)
+			ret = receive_loop(&contexts[0]);
+		else
+			ret = run_threads();
+
+		if (verbose || debug)
+			nfqueue_print_stats(stdout);
+	}
+
+	pthread_mutex_lock(&contexts_lock);
+	for (i = 0; i < context_count; i++) {
+		/* Packets still parked go with the socket */
+		for (j = 0; config->park_ended != NULL &&
+			    j < contexts[i].parked_count; j++)
+			config->park_ended(contexts[i].parked[j].key);
+		if (contexts[i].sock != NULL)
+			contexts[i].transport->close(contexts[i].sock);
+		if (contexts[i].event_fd >= 0)
+			close(contexts[i].event_fd);
+		free(contexts[i].parked);
+	}
+	free(contexts);
+	contexts = NULL;
+	context_count = 0;
+	pthread_mutex_unlock(&contexts_lock);
+	return ret;
+}
+
+/*
+ * Shed load after an overrun (N < 0) or when several receive passes in a
+ * row returned all RECV_VLEN datagrams they could, so more were waiting.
+ */
+static void update_pressure(struct queue_context *ctx, int n)
+{
+	int shedding;
+
+	if (n < 0 || (n == RECV_VLEN && ++ctx->full_passes >= PRESSURE_PASSES))
+		ctx->shed_until_ns = ctx->received_ns + SHED_HOLD_NS;
+	else if (n < RECV_VLEN)
+		ctx->full_passes = 0;
+
+	shedding = ctx->received_ns < ctx->shed_until_ns;
+	if (shedding != ctx->shedding && (verbose || debug))
+		printf("Queue %u %s\n", ctx->queue_num,
+		       shedding ? "is falling behind, shedding load" :
+				  "caught up");
+	ctx->shedding = shedding;
 }
 
-static int nfq_send_verdict(int queue_num, int id)
+static int receive_loop(struct queue_context *ctx)
 {
+	size_t buffer_size = BUFFER_SIZE;
+	struct mmsghdr msgs[RECV_VLEN];
+	struct iovec iovecs[RECV_VLEN];
+	struct sockaddr_nl addrs[RECV_VLEN];
+	char *bufs;
+	int fd = ctx->fd;
+	int i, n, flags, ret = EXIT_SUCCESS;
+
+	bufs = malloc(buffer_size * RECV_VLEN);
+	if (bufs == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
 	if (debug)
-		printf("Sending verdict for %i in queue %i\n", id, queue_num);
+		printf("Listening for packages in queue %u\n", ctx->queue_num);
+
+	while (!stop_requested) {
+		for (i = 0; i < RECV_VLEN; i++) {
+			iovecs[i].iov_base = bufs + i * buffer_size;
+			iovecs[i].iov_len = buffer_size;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			/* Not filled in by every transport */
+			addrs[i].nl_pid = 0;
+		}
+
+		/* Block for the first datagram, then take what is queued */
+		flags = MSG_WAITFORONE;
+		if (ctx->parked_count > 0) {
+			n = wait_parked(ctx);
+			if (n < 0) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+			if (n == 0)
+				continue;
+			flags = MSG_DONTWAIT;
+		}
+
+		n = recvmmsg(fd, msgs, RECV_VLEN, flags, NULL);
+		ctx->received_ns = now_ns();
+		if (report_requested && context_count == 1) {
+			report_requested = 0;
+			nfqueue_print_stats(stdout);
+		}
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/* The socket buffer overran and packets passed the
+			   queue, the next receive goes on after the loss */
+			if (errno == ENOBUFS && ctx->config->overload) {
+				STAT_ADD(ctx, enobufs, 1);
+				update_pressure(ctx, -1);
+				continue;
+			}
+			perror("recvmmsg");
+			ret = EXIT_FAILURE;
+			break;
+		}
+		STAT_ADD(ctx, recv_calls, 1);
+		STAT_ADD(ctx, datagrams, n);
+		if (ctx->config->overload)
+			update_pressure(ctx, n);
+
+		for (i = 0; i < n; i++) {
+			if (addrs[i].nl_pid != 0 ||
+			    msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				fprintf(stderr, "Ignoring invalid netlink message\n");
+				continue;
+			}
+
+			if (mnl_cb_run(iovecs[i].iov_base, msgs[i].msg_len, 0,
+				       ctx->portid, recv_callback, ctx) < 0) {
+				fprintf(stderr, "mnl_cb_run\n");
+				ret = EXIT_FAILURE;
+				break;
+			}
+		}
+
+		if (flush_verdicts(ctx) < 0 || ret != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	free(bufs);
+	return ret;
+}
+
+/*
+ * Add the kernel's counters of our queues.  Packets the queue can't take
+ * pass unseen with NFQA_CFG_F_FAIL_OPEN.  Those that found the netlink
+ * socket full still got an id, so the ids that neither got a verdict nor
+ * wait for one tell how many went by.  A full queue isn't counted at all.
+ * Called with contexts_lock held.
+ */
+static void read_kernel_stats(struct nfqueue_stats *stats)
+{
+	unsigned int num, portid, total, mode, range, dropped, user_dropped;
+	unsigned int id_sequence, i;
+	char line[128];
+	FILE *file;
+
+	if (context_count == 0)
+		return;
+	file = fopen(PROC_QUEUE_STATS, "r");
+	if (file == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		struct queue_context *ctx;
+		uint32_t missed;
+
+		if (sscanf(line, "%u %u %u %u %u %u %u %u", &num, &portid,
+			   &total, &mode, &range, &dropped, &user_dropped,
+			   &id_sequence) != 8)
+			continue;
+		i = num - contexts[0].queue_num;
+		if (num < contexts[0].queue_num || i >= context_count)
+			continue;
+		ctx = &contexts[i];
+		if (ctx->sock == NULL || portid != ctx->portid)
+			continue;
+
+		stats->backlog += total;
+		stats->kernel_dropped += dropped + user_dropped;
+		/* Ids wrap around, and a verdict sent since the file was read
+		   makes it look negative */
+		missed = id_sequence - total -
+			 (uint32_t)__atomic_load_n(&ctx->stats.verdicts,
+						   __ATOMIC_RELAXED);
+		if (missed < UINT32_MAX / 2)
+			stats->bypassed += missed;
+	}
+	fclose(file);
+}
+
+void nfqueue_get_stats(struct nfqueue_stats *stats)
+{
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&contexts_lock);
+	for (i = 0; i < context_count; i++) {
+		const struct nfqueue_stats *q = &contexts[i].stats;
+
+		stats->packets += __atomic_load_n(&q->packets, __ATOMIC_RELAXED);
+		stats->recv_calls +=
+			__atomic_load_n(&q->recv_calls, __ATOMIC_RELAXED);
+		stats->datagrams +=
+			__atomic_load_n(&q->datagrams, __ATOMIC_RELAXED);
+		stats->verdicts +=
+			__atomic_load_n(&q->verdicts, __ATOMIC_RELAXED);
+		stats->verdict_msgs +=
+			__atomic_load_n(&q->verdict_msgs, __ATOMIC_RELAXED);
+		stats->verdict_errors +=
+			__atomic_load_n(&q->verdict_errors, __ATOMIC_RELAXED);
+		stats->parked += __atomic_load_n(&q->parked, __ATOMIC_RELAXED);
+		stats->released +=
+			__atomic_load_n(&q->released, __ATOMIC_RELAXED);
+		stats->expired += __atomic_load_n(&q->expired, __ATOMIC_RELAXED);
+		stats->marked += __atomic_load_n(&q->marked, __ATOMIC_RELAXED);
+		stats->enobufs += __atomic_load_n(&q->enobufs, __ATOMIC_RELAXED);
+		stats->shed += __atomic_load_n(&q->shed, __ATOMIC_RELAXED);
+	}
+	read_kernel_stats(stats);
+	pthread_mutex_unlock(&contexts_lock);
+}
+
+void nfqueue_print_stats(FILE *stream)
+{
+	void (*report)(FILE *stream) = NULL;
+	struct nfqueue_stats stats;
+	struct timespec now;
+	double elapsed;
+
+	nfqueue_get_stats(&stats);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start_time.tv_sec) +
+		  (now.tv_nsec - start_time.tv_nsec) / 1e9;
+
+	fprintf(stream,
+		"%lu packets in %.1f s (%.1f packets/s), "
+		"%.2f packets per receive syscall, %lu datagrams, "
+		"%lu verdict messages (%lu syscalls saved), %lu verdict errors\n",
+		stats.packets, elapsed,
+		elapsed > 0 ? stats.packets / elapsed : 0.0,
+		stats.recv_calls ? (double)stats.packets / stats.recv_calls : 0.0,
+		stats.datagrams, stats.verdict_msgs,
+		stats.verdicts - stats.verdict_msgs, stats.verdict_errors);
+	if (stats.parked)
+		fprintf(stream,
+			"%lu packets parked, %lu released, %lu expired\n",
+			stats.parked, stats.released, stats.expired);
+	if (stats.marked)
+		fprintf(stream, "%lu flows marked to bypass the queue\n",
+			stats.marked);
+	if (stats.enobufs || stats.shed || stats.kernel_dropped ||
+	    stats.bypassed)
+		fprintf(stream,
+			"%lu socket overruns, %lu packets while shedding load, "
+			"%lu dropped and %lu passed unseen by the kernel, "
+			"%lu waiting\n",
+			stats.enobufs, stats.shed, stats.kernel_dropped,
+			stats.bypassed, stats.backlog);
+	/* The report may ask for the stats again, so it runs unlocked */
+	pthread_mutex_lock(&contexts_lock);
+	if (contexts != NULL)
+		report = contexts[0].config->report;
+	pthread_mutex_unlock(&contexts_lock);
+	if (report != NULL)
+		report(stream);
+	fflush(stream);
+}
+
+/* Wake up all receive threads to check their parked packets */
+void nfqueue_notify()
+{
+	uint64_t one = 1;
+	unsigned int i;
+
+	pthread_mutex_lock(&contexts_lock);
+	for (i = 0; i < context_count; i++)
+		if (contexts[i].event_fd >= 0 &&
+		    write(contexts[i].event_fd, &one, sizeof(one)) < 0 &&
+		    errno != EAGAIN)
+			perror("write(eventfd)");
+	pthread_mutex_unlock(&contexts_lock);
+}
+
+/* Append a verdict message to the datagram being built in verdict_buf */
+static size_t put_verdict(struct queue_context *ctx, size_t offset, int type,
+			  uint32_t id, int verdict)
+{
+	struct nlmsghdr *nlh;
 
-	char buf[MNL_SOCKET_BUFFER_SIZE];
+	nlh = nfq_nlmsg_put(ctx->verdict_buf + offset, type, ctx->queue_num);
+	nfq_nlmsg_verdict_put(nlh, id, verdict);
+	return offset + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/*
+ * Accept a packet and set the flow mark bits on its connection, and on the
+ * packet for rules further on.  The conntrack mark is only set with the
+ * nf_conntrack_netlink module loaded.
+ */
+static size_t put_marked_verdict(struct queue_context *ctx, size_t offset,
+				 uint32_t id, uint32_t mark)
+{
+	const struct nfqueue_config *config = ctx->config;
 	struct nlmsghdr *nlh;
+	struct nlattr *nest;
 
-	nlh = nfq_nlmsg_put(buf, NFQNL_MSG_VERDICT, queue_num);
+	nlh = nfq_nlmsg_put(ctx->verdict_buf + offset, NFQNL_MSG_VERDICT,
+			    ctx->queue_num);
 	nfq_nlmsg_verdict_put(nlh, id, NF_ACCEPT);
+	nfq_nlmsg_verdict_put_mark(nlh, (mark & ~config->flow_mark_mask) |
+						config->flow_mark);
+	nest = mnl_attr_nest_start(nlh, NFQA_CT);
+	mnl_attr_put_u32(nlh, CTA_MARK, htonl(config->flow_mark));
+	mnl_attr_put_u32(nlh, CTA_MARK_MASK, htonl(config->flow_mark_mask));
+	mnl_attr_nest_end(nlh, nest);
+	return offset + NLMSG_ALIGN(nlh->nlmsg_len);
+}
 
-	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+/* Send all verdict messages in verdict_buf with a single syscall */
+static int send_verdicts(struct queue_context *ctx, size_t len)
+{
+	if (len == 0)
+		return MNL_CB_OK;
+
+	if (ctx->transport->send(ctx->sock, ctx->verdict_buf, len) < 0) {
 		fprintf(stderr, "Failed sending verdict\n");
+		STAT_ADD(ctx, verdict_errors, 1);
 		return MNL_CB_ERROR;
 	}
 
+	STAT_ADD(ctx, verdict_msgs, 1);
 	return MNL_CB_OK;
 }
 
+static int flush_verdicts(struct queue_context *ctx)
+{
+	unsigned int i;
+	uint32_t max_id = 0, oldest_parked = 0;
+	int have_batch = 0;
+	size_t len = 0;
+	int ret;
+
+	if (ctx->batch_count == 0 && ctx->marked_count == 0)
+		return MNL_CB_OK;
+
+	if (debug)
+		printf("Sending verdicts for %u packets in queue %u\n",
+		       ctx->batch_count + ctx->marked_count, ctx->queue_num);
+
+	for (i = 0; i < ctx->marked_count; i++)
+		len = put_marked_verdict(ctx, len, ctx->marked_ids[i],
+					 ctx->marked_marks[i]);
+
+	/* Ids wrap around, so they are compared by their distance */
+	if (ctx->parked_count)
+		oldest_parked = ctx->parked[0].id;
+	for (i = 0; i < ctx->batch_count; i++) {
+		uint32_t id = ctx->batch_ids[i];
+
+		if (!ctx->parked_count || (int32_t)(id - oldest_parked) < 0) {
+			if (!have_batch || (int32_t)(id - max_id) > 0)
+				max_id = id;
+			have_batch = 1;
+		} else {
+			len = put_verdict(ctx, len, NFQNL_MSG_VERDICT, id,
+					  NF_ACCEPT);
+		}
+	}
+	if (have_batch) {
+		len = put_verdict(ctx, len, NFQNL_MSG_VERDICT_BATCH, max_id,
+				  NF_ACCEPT);
+	}
+
+	ret = send_verdicts(ctx, len);
+	if (ret != MNL_CB_ERROR) {
+		STAT_ADD(ctx, verdicts, ctx->batch_count + ctx->marked_count);
+		STAT_ADD(ctx, marked, ctx->marked_count);
+		metrics_record_n(METRIC_VERDICT, now_ns() - ctx->received_ns,
+				 ctx->batch_count + ctx->marked_count);
+	}
+	ctx->batch_count = 0;
+	ctx->marked_count = 0;
+
+	for (i = 0; i < ctx->deferred_count; i++)
+		ctx->callback(&ctx->deferred[i]);
+	ctx->deferred_count = 0;
+
+	if (debug)
+		printf("%lu syscalls saved by batching verdicts\n",
+		       ctx->stats.verdicts - ctx->stats.verdict_msgs);
+
+	return ret;
+}
+
+/* Release or expire parked packets, all in one datagram */
+static int check_parked(struct queue_context *ctx)
+{
+	const struct nfqueue_config *config = ctx->config;
+	uint64_t now_nsec = now_ns(), now = now_nsec / 1000000;
+	unsigned int i, kept = 0, released = 0, expired = 0, marked = 0;
+	size_t len = 0;
+	int ret;
+
+	/* Accepted packets go first, they may be covered by a batch verdict */
+	if (flush_verdicts(ctx) < 0)
+		return -1;
+
+	for (i = 0; i < ctx->parked_count; i++) {
+		struct parked_packet *p = &ctx->parked[i];
+		int verdict;
+
+		if (config->park_released(p->key)) {
+			verdict = NF_ACCEPT;
+			released++;
+		} else if (now >= p->deadline) {
+			verdict = config->park_drop ? NF_DROP : NF_ACCEPT;
+			expired++;
+		} else {
+			ctx->parked[kept++] = *p;
+			continue;
+		}
+
+		metrics_record(METRIC_VERDICT, now_nsec - p->received_ns);
+		if (len + VERDICT_MSG_SIZE > sizeof(ctx->verdict_buf)) {
+			if (send_verdicts(ctx, len) < 0) {
+				/* The packets not handled yet stay parked */
+				memmove(&ctx->parked[kept], p,
+					(ctx->parked_count - i) * sizeof(*p));
+				ctx->parked_count = kept + ctx->parked_count - i;
+				return -1;
+			}
+			len = 0;
+		}
+		if (verdict == NF_ACCEPT && p->mark_flow) {
+			len = put_marked_verdict(ctx, len, p->id, p->mark);
+			marked++;
+		} else {
+			len = put_verdict(ctx, len, NFQNL_MSG_VERDICT, p->id,
+					  verdict);
+		}
+		if (config->park_ended != NULL)
+			config->park_ended(p->key);
+	}
+	ctx->parked_count = kept;
+
+	ret = send_verdicts(ctx, len);
+	STAT_ADD(ctx, marked, marked);
+	STAT_ADD(ctx, released, released);
+	STAT_ADD(ctx, expired, expired);
+	STAT_ADD(ctx, verdicts, released + expired);
+
+	if (debug && (released || expired))
+		printf("Released %u and expired %u parked packets in queue %u\n",
+		       released, expired, ctx->queue_num);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * While packets are parked, wait for netlink data, a notification or the
+ * oldest packet's deadline. Returns 1 when netlink data is available.
+ */
+static int wait_parked(struct queue_context *ctx)
+{
+	struct pollfd fds[2];
+	uint64_t now = now_ms(), deadline = ctx->parked[0].deadline;
+	uint64_t events;
+	int timeout = deadline > now ? (int)(deadline - now) : 0;
+
+	fds[0].fd = ctx->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = ctx->event_fd;
+	fds[1].events = POLLIN;
+
+	if (poll(fds, 2, timeout) < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("poll");
+		return -1;
+	}
+
+	if (fds[1].revents & POLLIN) {
+		if (read(ctx->event_fd, &events, sizeof(events)) < 0 &&
+		    errno != EAGAIN)
+			perror("read(eventfd)");
+	}
+
+	if (check_parked(ctx) < 0)
+		return -1;
+
+	return (fds[0].revents & POLLIN) != 0;
+}
+
+static int park_packet(struct queue_context *ctx, uint32_t id,
+		       const struct nfqueue_packet *packet, uint32_t mark)
+{
+	struct parked_packet *p;
+
+	if (ctx->parked_count == MAX_PARKED)
+		return -1;
+
+	p = &ctx->parked[ctx->parked_count++];
+	p->id = id;
+	p->key = packet->park_key;
+	p->mark_flow = packet->mark_flow;
+	p->mark = mark;
+	p->deadline = now_ms() + ctx->config->park_timeout_ms;
+	p->received_ns = ctx->received_ns;
+	STAT_ADD(ctx, parked, 1);
+	return 0;
+}
+
 static int recv_callback(const struct nlmsghdr *nlh, void *data)
 {
-	int id, queue_num;
+	uint32_t id, mark = 0;
 	struct nfqnl_msg_packet_hdr *ph;
-	struct nfgenmsg *nfg;
 	struct nlattr *attr[NFQA_MAX + 1] = {};
-	int (*callback)() = data;
+	struct queue_context *ctx = data;
+	struct nfqueue_packet packet = { NULL, 0, NULL, 0, ctx->shedding };
 
 	if (debug)
 		puts("Received NFQUEUE callback");
-	callback();
 
 	if (nfq_nlmsg_parse(nlh, attr) < 0) {
 		fprintf(stderr, "nfq_nlmsg_parse() failed");
 		return MNL_CB_ERROR;
 	}
 
-	nfg = mnl_nlmsg_get_payload(nlh);
+	if (attr[NFQA_PAYLOAD] != NULL) {
+		packet.payload = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
+		packet.len = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
+	}
 
 	if (attr[NFQA_PACKET_HDR] == NULL) {
 		fprintf(stderr, "metaheader not set\n");
@@ -155,7 +971,39 @@ static int recv_callback(const struct nlmsghdr *nlh, void *data)
 	}
 
 	id = ntohl(ph->packet_id);
-	queue_num = ntohs(nfg->res_id);
+	if (attr[NFQA_MARK] != NULL)
+		mark = ntohl(mnl_attr_get_u32(attr[NFQA_MARK]));
+	STAT_ADD(ctx, packets, 1);
+	if (ctx->shedding)
+		STAT_ADD(ctx, shed, 1);
+
+	/* When waking happens in a different thread, the callback only hands
+	 * over the request and the packet can be accepted before that.
+	 * While shedding load, nothing is parked, so the packets of a receive
+	 * pass leave with a single batch verdict.
+	 */
+	if (!ctx->config->async &&
+	    ctx->callback(&packet) == NFQUEUE_PARK) {
+		/* A full parking lot lets the packet pass right away */
+		if (ctx->parked != NULL && !ctx->shedding &&
+		    park_packet(ctx, id, &packet, mark) == 0)
+			return MNL_CB_OK;
+		if (ctx->config->park_ended != NULL)
+			ctx->config->park_ended(packet.park_key);
+	}
 
-	return nfq_send_verdict(queue_num, id);
-}
\ No newline at end of file
+	if (packet.mark_flow) {
+		ctx->marked_ids[ctx->marked_count] = id;
+		ctx->marked_marks[ctx->marked_count++] = mark;
+	} else {
+		ctx->batch_ids[ctx->batch_count++] = id;
+	}
+	if (ctx->config->async)
+		ctx->deferred[ctx->deferred_count++] = packet;
+
+	if (ctx->batch_count + ctx->marked_count == MAX_BATCH &&
+	    flush_verdicts(ctx) < 0)
+		return MNL_CB_ERROR;
+
+	return MNL_CB_OK;
+}
@@ -1,8 +1,114 @@
 #ifndef ETHERWAKENFQUEUE_NFQUEUE_H
 #define ETHERWAKENFQUEUE_NFQUEUE_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-int nfqueue_receive(uint16_t queue_num, int (*callback)());
+/* Queues one process receives from, each with a thread of its own */
+#define NFQUEUE_MAX_QUEUES 1024
+
+/* Return values of nfqueue_callback */
+enum {
+	NFQUEUE_ACCEPT,
+	/* Leave the packet in the queue until released or expired */
+	NFQUEUE_PARK,
+};
+
+struct nfqueue_packet {
+	/* NULL when no data is copied */
+	const unsigned char *payload;
+	uint16_t len;
+	/* Set by the callback when parking the packet */
+	void *park_key;
+	/* Set by the callback to tag the packet's connection with
+	   config->flow_mark, not available in async mode */
+	int mark_flow;
+	/* Set while the queue falls behind, the callback should do as little
+	   as it can */
+	int overloaded;
+};
+
+/* Called for every queued packet.
+ * With several queues, it is called from several threads at once. */
+typedef int (*nfqueue_callback)(struct nfqueue_packet *packet);
+
+/* Carries netlink messages between a queue and the kernel.  The receive
+ * loop reads datagrams from the returned file descriptor itself. */
+struct nfqueue_transport {
+	/* Returns a socket for queue QUEUE_NUM or NULL */
+	void *(*open)(uint16_t queue_num);
+	int (*get_fd)(void *sock);
+	unsigned int (*get_portid)(void *sock);
+	ssize_t (*send)(void *sock, const void *buf, size_t len);
+	void (*close)(void *sock);
+};
+
+struct nfqueue_config {
+	/* First queue and number of queues, each with its own thread */
+	uint16_t queue_num;
+	uint16_t queue_count;
+	/* Send the verdict before running the callback */
+	int async;
+	/* Number of bytes of each packet to copy to userspace, 0 for metadata */
+	uint16_t copy_range;
+	/* Netlink socket receive buffer in bytes, 0 for the system default */
+	int rcvbuf;
+	/* Maximum number of packets waiting in the queue, 0 for the default */
+	uint32_t queue_maxlen;
+	/* Maximum time a packet may be parked, 0 disables parking */
+	unsigned int park_timeout_ms;
+	/* Drop instead of accept parked packets when they expire */
+	int park_drop;
+	/* Conntrack mark bits set on flows the callback asks for, the
+	   packet mark gets them as well */
+	uint32_t flow_mark;
+	uint32_t flow_mark_mask;
+	/* Get ENOBUFS when the kernel loses packets and shed load while
+	   falling behind */
+	int overload;
+	/* Tells whether packets parked with KEY may pass now */
+	int (*park_released)(void *key);
+	/* Called for each packet parked with KEY once it got its verdict,
+	   or when it couldn't be parked, may be NULL */
+	void (*park_ended)(void *key);
+	/* Prints further statistics after those of the queues, may be NULL */
+	void (*report)(FILE *stream);
+	/* NULL for a netlink socket to the kernel */
+	const struct nfqueue_transport *transport;
+};
+
+struct nfqueue_stats {
+	unsigned long packets;
+	/* Receive syscalls and the netlink datagrams they returned */
+	unsigned long recv_calls;
+	unsigned long datagrams;
+	/* Packets with a verdict and the number of datagrams it took */
+	unsigned long verdicts;
+	unsigned long verdict_msgs;
+	unsigned long verdict_errors;
+	/* Packets parked and how they left the queue */
+	unsigned long parked;
+	unsigned long released;
+	unsigned long expired;
+	/* Packets whose connection got the flow mark */
+	unsigned long marked;
+	/* Overruns of the netlink socket reported with ENOBUFS */
+	unsigned long enobufs;
+	/* Packets received while shedding load */
+	unsigned long shed;
+	/* From /proc/net/netfilter/nfnetlink_queue: packets waiting for a
+	   verdict, dropped by the kernel, and those that passed the queue
+	   unseen, e.g. with the queue full */
+	unsigned long backlog;
+	unsigned long kernel_dropped;
+	unsigned long bypassed;
+};
+
+int nfqueue_receive(const struct nfqueue_config *config,
+		    nfqueue_callback callback);
+void nfqueue_get_stats(struct nfqueue_stats *stats);
+void nfqueue_print_stats(FILE *stream);
+void nfqueue_notify();
 
 #endif //ETHERWAKENFQUEUE_NFQUEUE_H
@@ -15,19 +15,27 @@
 */
 
 #include <stdio.h>
-#include <signal.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
 #include <netdb.h>
 #include <errno.h>
 #include <string.h>
-#include <fcntl.h>
 #include <stdbool.h>
-#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "ping.h"
 
 enum {
 	DEFDATALEN = 56,
@@ -35,63 +43,149 @@ enum {
 	MAXICMPLEN = 76,
 };
 
-int socket_fd = 0;
-struct icmp *ping_packet;
-struct sockaddr_in receive_addr;
-char send_packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-char receive_packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+/* Probes sent to a host whose replies are still accepted */
+#define MAX_INFLIGHT 8
+/* Time between probes to the same host and the timer granularity */
+#define PROBE_INTERVAL_MS 500
+#define TICK_MS 50
+
+/* From linux/icmp.h, which clashes with netinet/ip_icmp.h */
+#define ICMP_FILTER 1
+struct icmp_filter {
+	uint32_t data;
+};
 
-int timeout = 0;
+extern int debug;
 
-int get_dest_addr(const char *hostname)
+/*
+ * Probing engine: a single thread waits on the raw ICMP and ICMPv6 sockets,
+ * a timerfd and an eventfd with epoll. Any number of hosts of either family
+ * can be probed at once, replies are matched by their source address, ICMP
+ * id (one per host) and sequence number.
+ */
+struct ping_host {
+	int family;
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} addr;
+	socklen_t addr_len;
+	char name[INET6_ADDRSTRLEN];
+	uint16_t id;
+	uint16_t seq;
+	uint64_t sent_us[MAX_INFLIGHT];
+
+	int active;
+	uint64_t next_probe_ms;
+	uint64_t deadline_ms;
+	ping_callback callback;
+	void *arg;
+
+	unsigned long probes;
+	unsigned long replies;
+	double last_rtt_ms;
+};
+
+static int socket_fd = -1;
+static int socket6_fd = -1;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int event_fd = -1;
+static pthread_t thread;
+static int running = 0;
+static int stopping = 0;
+static int timer_armed = 0;
+
+/* Protects hosts and their probing state */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ping_host **hosts = NULL;
+static unsigned int host_count = 0;
+static uint16_t id_base;
+
+static char send_packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+static char receive_packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+
+static uint64_t now_us()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* HOSTNAME may be an IPv4 or IPv6 address, the latter with a scope like
+   fe80::1%eth0, or a name */
+static int get_dest_addr(const char *hostname, struct ping_host *host)
 {
 	struct addrinfo hints, *res;
-	int ret;
 
-	ret = inet_aton(hostname, &receive_addr.sin_addr);
-	if (ret == 0) {
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_socktype = SOCK_RAW;
-		hints.ai_family = AF_INET;
+	memset(&host->addr, 0, sizeof(host->addr));
+	if (inet_pton(AF_INET, hostname, &host->addr.in.sin_addr) == 1) {
+		host->family = AF_INET;
+		host->addr.in.sin_family = AF_INET;
+		host->addr_len = sizeof(host->addr.in);
+		return true;
+	}
 
-		if (getaddrinfo(hostname, NULL, &hints, &res) != 0) {
-			fprintf(stderr, "getaddrinfo() failed\n");
-			return false;
-		}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_RAW;
+	hints.ai_family = AF_UNSPEC;
 
-		memcpy(&receive_addr.sin_addr,
-		       &((struct sockaddr_in *)res->ai_addr)->sin_addr,
-		       sizeof(struct in_addr));
+	if (getaddrinfo(hostname, NULL, &hints, &res) != 0) {
+		fprintf(stderr, "getaddrinfo() failed\n");
+		return false;
+	}
+	if (res->ai_family != AF_INET && res->ai_family != AF_INET6) {
 		freeaddrinfo(res);
+		return false;
 	}
+	host->family = res->ai_family;
+	host->addr_len = res->ai_addrlen;
+	memcpy(&host->addr, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
 
 	return true;
 }
 
-static int create_icmp_socket()
+/* Only echo replies are passed by the kernel, the ping thread isn't woken
+   for everything else arriving on the raw sockets */
+static int create_icmp_socket(int family)
 {
-	struct protoent *protocol;
-	protocol = getprotobyname("icmp");
-	if (protocol == NULL) {
-		perror("getprotobyname() failed");
-		return false;
-	}
+	struct icmp_filter filter;
+	struct icmp6_filter filter6;
+	int fd, ret;
 
-	socket_fd = socket(AF_INET, SOCK_RAW, protocol->p_proto);
-	if (socket_fd < 0) {
+	fd = socket(family, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    family == AF_INET6 ? IPPROTO_ICMPV6 : IPPROTO_ICMP);
+	if (fd < 0) {
 		if (errno == EPERM) {
 			fprintf(stderr,
 				"Failed creating network socket. Are you root?");
+		} else if (family == AF_INET6) {
+			/* IPv6 may well be disabled */
+			if (debug)
+				perror("socket(AF_INET6) failed");
 		} else {
 			perror("socket() failed");
 		}
-		return false;
+		return -1;
 	}
 
-	int flags = fcntl(socket_fd, F_GETFL);
-	fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+	if (family == AF_INET6) {
+		ICMP6_FILTER_SETBLOCKALL(&filter6);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter6);
+		ret = setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter6,
+				 sizeof(filter6));
+	} else {
+		filter.data = ~(1u << ICMP_ECHOREPLY);
+		ret = setsockopt(fd, SOL_RAW, ICMP_FILTER, &filter,
+				 sizeof(filter));
+	}
+	if (ret < 0 && debug)
+		perror("setsockopt(ICMP_FILTER)");
 
-	return true;
+	return fd;
 }
 
 static uint16_t cal_chksum(uint16_t *addr, int nleft)
@@ -120,89 +214,502 @@ static uint16_t cal_chksum(uint16_t *addr, int nleft)
 	return (uint16_t)~sum;
 }
 
-static void create_ping_packet(uint16_t process_pid)
+static void send_probe(struct ping_host *host, uint64_t now)
 {
-	ping_packet = (struct icmp *)send_packet;
-	ping_packet->icmp_type = ICMP_ECHO;
-	ping_packet->icmp_id = process_pid;
-	ping_packet->icmp_cksum =
-		cal_chksum((uint16_t *)ping_packet, sizeof(send_packet));
+	struct icmp *ping_packet = (struct icmp *)send_packet;
+	struct icmp6_hdr *ping6_packet = (struct icmp6_hdr *)send_packet;
+	size_t len;
+	int fd;
+
+	host->seq++;
+	host->sent_us[host->seq % MAX_INFLIGHT] = now;
+	host->probes++;
+
+	if (host->family == AF_INET6) {
+		/* The kernel fills in the checksum, it covers the IPv6 header */
+		len = DEFDATALEN + sizeof(*ping6_packet);
+		memset(send_packet, 0, len);
+		ping6_packet->icmp6_type = ICMP6_ECHO_REQUEST;
+		ping6_packet->icmp6_id = htons(host->id);
+		ping6_packet->icmp6_seq = htons(host->seq);
+		fd = socket6_fd;
+	} else {
+		len = DEFDATALEN + ICMP_MINLEN;
+		memset(send_packet, 0, len);
+		ping_packet->icmp_type = ICMP_ECHO;
+		ping_packet->icmp_id = htons(host->id);
+		ping_packet->icmp_seq = htons(host->seq);
+		ping_packet->icmp_cksum =
+			cal_chksum((uint16_t *)ping_packet, len);
+		fd = socket_fd;
+	}
+
+	if (sendto(fd, send_packet, len, 0, &host->addr.sa,
+		   host->addr_len) < 0) {
+		perror("sendto()");
+	}
 }
 
-int setup_ping(const char *hostname)
+static void arm_timer(int on)
 {
-	uint16_t process_pid;
+	struct itimerspec spec;
 
-	if (!get_dest_addr(hostname)) {
-		fprintf(stderr,
-			"Failed getting destination address! Is the address correct?\n");
-		return false;
+	if (on == timer_armed)
+		return;
+
+	memset(&spec, 0, sizeof(spec));
+	if (on) {
+		spec.it_value.tv_nsec = TICK_MS * 1000000L;
+		spec.it_interval.tv_nsec = TICK_MS * 1000000L;
 	}
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+	timer_armed = on;
+}
+
+struct completion {
+	struct ping_host *host;
+	int online;
+};
+
+/* Completions collected under the lock, called back outside of it.
+   Only the ping thread uses them, so it grows them as well. */
+static struct completion *done_list = NULL;
+static unsigned int done_size = 0;
+
+/* Called with the lock held, callbacks run after releasing it */
+static void finish(struct ping_host *host, int online,
+		   struct completion *done, unsigned int *done_count)
+{
+	host->active = 0;
+	done[*done_count].host = host;
+	done[*done_count].online = online;
+	(*done_count)++;
+}
+
+static void run_callbacks(struct completion *done, unsigned int done_count)
+{
+	unsigned int i;
+
+	for (i = 0; i < done_count; i++)
+		done[i].host->callback(done[i].host, done[i].online,
+				       done[i].host->arg);
+}
+
+static void handle_timer(struct completion *done, unsigned int *done_count)
+{
+	uint64_t expirations;
+	uint64_t now = now_us(), now_ms = now / 1000;
+	unsigned int i;
+	int any_active = 0;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		perror("read(timerfd)");
+
+	for (i = 0; i < host_count; i++) {
+		struct ping_host *host = hosts[i];
+
+		if (!host->active)
+			continue;
+
+		if (now_ms >= host->deadline_ms) {
+			if (debug)
+				printf("No reply from %s after %lu probes\n",
+				       host->name, host->probes);
+			finish(host, 0, done, done_count);
+		} else {
+			if (now_ms >= host->next_probe_ms) {
+				send_probe(host, now);
+				host->next_probe_ms = now_ms + PROBE_INTERVAL_MS;
+			}
+			any_active = 1;
+		}
+	}
+	arm_timer(any_active);
+}
+
+/* Whether a reply from FROM may answer a probe to HOST */
+static int from_host(const struct ping_host *host, int family,
+		     const struct sockaddr_storage *from)
+{
+	if (host->family != family)
+		return 0;
+	if (family == AF_INET6)
+		return memcmp(&((const struct sockaddr_in6 *)from)->sin6_addr,
+			      &host->addr.in6.sin6_addr,
+			      sizeof(struct in6_addr)) == 0;
+	return ((const struct sockaddr_in *)from)->sin_addr.s_addr ==
+		host->addr.in.sin_addr.s_addr;
+}
+
+/* Raw ICMP sockets pass the IP header, ICMPv6 ones don't */
+static void handle_replies(int fd, int family, struct completion *done,
+			   unsigned int *done_count)
+{
+	struct sockaddr_storage from;
+	socklen_t from_len = sizeof(from);
+	ssize_t c;
+	uint64_t now;
+
+	while ((c = recvfrom(fd, receive_packet, sizeof(receive_packet), 0,
+			     (struct sockaddr *)&from, &from_len)) >= 0) {
+		struct iphdr *iphdr = (struct iphdr *)receive_packet;
+		struct icmp *icmp;
+		struct icmp6_hdr *icmp6;
+		struct ping_host *host;
+		uint16_t index, seq, id;
+
+		from_len = sizeof(from);
+		if (family == AF_INET6) {
+			if (c < (ssize_t)sizeof(*icmp6))
+				continue;
+			icmp6 = (struct icmp6_hdr *)receive_packet;
+			if (icmp6->icmp6_type != ICMP6_ECHO_REPLY)
+				continue;
+			id = ntohs(icmp6->icmp6_id);
+			seq = ntohs(icmp6->icmp6_seq);
+		} else {
+			if (c < (iphdr->ihl << 2) + ICMP_MINLEN)
+				continue;
+			icmp = (struct icmp *)(receive_packet +
+					       (iphdr->ihl << 2));
+			if (icmp->icmp_type != ICMP_ECHOREPLY)
+				continue;
+			id = ntohs(icmp->icmp_id);
+			seq = ntohs(icmp->icmp_seq);
+		}
+
+		index = id - id_base;
+		if (index >= host_count)
+			continue;
+		host = hosts[index];
+		if (!from_host(host, family, &from))
+			continue;
+
+		/* Only replies to one of the recent probes count */
+		if ((uint16_t)(host->seq - seq) >= MAX_INFLIGHT ||
+		    host->probes == 0)
+			continue;
+
+		now = now_us();
+		host->replies++;
+		host->last_rtt_ms =
+			(now - host->sent_us[seq % MAX_INFLIGHT]) / 1000.0;
+		if (debug)
+			printf("Reply from %s: seq=%u time=%.2f ms\n",
+			       host->name, seq, host->last_rtt_ms);
 
-	if (!create_icmp_socket()) {
+		if (host->active)
+			finish(host, 1, done, done_count);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		perror("recv()");
+}
+
+static void *ping_thread(void *data)
+{
+	struct epoll_event events[4];
+	struct completion *done;
+	unsigned int done_count;
+	uint64_t value;
+	int i, n;
+
+	(void)data;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(epoll_fd, events, 4, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		pthread_mutex_lock(&lock);
+		done_count = 0;
+		if (done_size < host_count) {
+			done = realloc(done_list, host_count * sizeof(*done));
+			if (done == NULL) {
+				pthread_mutex_unlock(&lock);
+				perror("realloc");
+				continue;
+			}
+			done_list = done;
+			done_size = host_count;
+		}
+		done = done_list;
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == socket_fd) {
+				handle_replies(fd, AF_INET, done, &done_count);
+			} else if (fd == socket6_fd) {
+				handle_replies(fd, AF_INET6, done, &done_count);
+			} else if (fd == timer_fd) {
+				handle_timer(done, &done_count);
+			} else if (fd == event_fd) {
+				if (read(event_fd, &value, sizeof(value)) < 0 &&
+				    errno != EAGAIN)
+					perror("read(eventfd)");
+				/* Send the first probe right away */
+				handle_timer(done, &done_count);
+			}
+		}
+		pthread_mutex_unlock(&lock);
+
+		run_callbacks(done, done_count);
+	}
+
+	return NULL;
+}
+
+static int add_to_epoll(int fd)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int setup_ping()
+{
+	sigset_t all, old;
+	int ret;
+
+	if (running)
+		return true;
+
+	/* Either family is enough, hosts of the other one can't be added */
+	socket_fd = create_icmp_socket(AF_INET);
+	socket6_fd = create_icmp_socket(AF_INET6);
+	if (socket_fd < 0 && socket6_fd < 0) {
 		fprintf(stderr,
 			"Failed creating ICMP socket?\n");
 		return false;
 	}
 
-	process_pid = htons(getpid());
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || timer_fd < 0 || event_fd < 0 ||
+	    (socket_fd >= 0 && add_to_epoll(socket_fd) < 0) ||
+	    (socket6_fd >= 0 && add_to_epoll(socket6_fd) < 0) ||
+	    add_to_epoll(timer_fd) < 0 || add_to_epoll(event_fd) < 0) {
+		perror("Failed setting up ping");
+		return false;
+	}
+
+	id_base = (uint16_t)(getpid() << 4);
 
-	create_ping_packet(process_pid);
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, ping_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating ping thread\n");
+		return false;
+	}
+	running = 1;
 
 	return true;
 }
 
-void alarm_handler(int signum)
+/* A host already probed at the address of HOST, called with the lock
+   held */
+static struct ping_host *find_host(const struct ping_host *host)
 {
-	(void)signum;
-	timeout = 1;
+	unsigned int i;
+
+	for (i = 0; i < host_count; i++)
+		if (from_host(hosts[i], host->family,
+			      (const struct sockaddr_storage *)&host->addr) &&
+		    (host->family != AF_INET6 ||
+		     hosts[i]->addr.in6.sin6_scope_id ==
+			     host->addr.in6.sin6_scope_id))
+			return hosts[i];
+	return NULL;
 }
 
-int send_ping()
+/* The host to probe at HOSTNAME, shared with targets replaced by others
+   at the same address */
+struct ping_host *ping_add_host(const char *hostname)
 {
-	ssize_t c;
-	int received = 0;
-	struct icmp *receive_icmp;
+	struct ping_host *host, *existing, **new_hosts;
 
-	if (sendto(socket_fd, ping_packet, DEFDATALEN + ICMP_MINLEN, 0,
-		   (struct sockaddr *)&receive_addr,
-		   sizeof(receive_addr)) < 0) {
-		perror("sendto()");
+	host = calloc(1, sizeof(*host));
+	if (host == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	if (!get_dest_addr(hostname, host)) {
+		fprintf(stderr,
+			"Failed getting destination address! Is the address correct?\n");
+		free(host);
+		return NULL;
 	}
+	if ((host->family == AF_INET6 ? socket6_fd : socket_fd) < 0) {
+		fprintf(stderr, "Can't ping %s without an %s socket\n", hostname,
+			host->family == AF_INET6 ? "ICMPv6" : "ICMP");
+		free(host);
+		return NULL;
+	}
+	if (host->family == AF_INET6)
+		inet_ntop(AF_INET6, &host->addr.in6.sin6_addr, host->name,
+			  sizeof(host->name));
+	else
+		inet_ntop(AF_INET, &host->addr.in.sin_addr, host->name,
+			  sizeof(host->name));
+
+	pthread_mutex_lock(&lock);
+	existing = find_host(host);
+	if (existing != NULL) {
+		pthread_mutex_unlock(&lock);
+		free(host);
+		return existing;
+	}
+	/* Each host has an ICMP id of its own */
+	if (host_count > UINT16_MAX) {
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "Can't ping more than %u hosts\n",
+			UINT16_MAX + 1);
+		free(host);
+		return NULL;
+	}
+	new_hosts = realloc(hosts, (host_count + 1) * sizeof(*hosts));
+	if (new_hosts == NULL) {
+		pthread_mutex_unlock(&lock);
+		perror("realloc");
+		free(host);
+		return NULL;
+	}
+	hosts = new_hosts;
+	host->id = id_base + host_count;
+	hosts[host_count++] = host;
+	pthread_mutex_unlock(&lock);
 
-	signal(SIGALRM, alarm_handler);
-	alarm(1);
+	return host;
+}
 
-	struct pollfd poll_struct;
-	poll_struct.fd = socket_fd;
-	poll_struct.events = POLLIN;
+/* Probe HOST until it replies or TIMEOUT_MS passed, then run CALLBACK
+   in the ping thread.  Returns false when HOST is already being probed. */
+int ping_start(struct ping_host *host, unsigned int timeout_ms,
+	       ping_callback callback, void *arg)
+{
+	uint64_t one = 1, now = now_us() / 1000;
 
-	while (!timeout && !received) {
-		poll(&poll_struct, 1, 1000);
-		c = recv(socket_fd, receive_packet, sizeof(receive_packet), 0);
+	pthread_mutex_lock(&lock);
+	if (host->active) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	host->active = 1;
+	host->callback = callback;
+	host->arg = arg;
+	host->next_probe_ms = now;
+	host->deadline_ms = now + timeout_ms;
+	pthread_mutex_unlock(&lock);
+
+	if (write(event_fd, &one, sizeof(one)) < 0)
+		perror("write(eventfd)");
+	return true;
+}
+
+struct waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	int online;
+};
+
+static void wake_waiter(struct ping_host *host, int online, void *arg)
+{
+	struct waiter *waiter = arg;
+
+	(void)host;
+	pthread_mutex_lock(&waiter->lock);
+	waiter->done = 1;
+	waiter->online = online;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->lock);
+}
+
+/* Blocking variant of ping_start(), returns true when HOST replied */
+int ping_wait(struct ping_host *host, unsigned int timeout_ms)
+{
+	struct waiter waiter = { PTHREAD_MUTEX_INITIALIZER,
+				 PTHREAD_COND_INITIALIZER, 0, 0 };
 
-		if (c < 0) {
-			if (errno != EINTR && errno != EAGAIN &&
-			    errno != EWOULDBLOCK)
-				perror("recv()");
+	if (!ping_start(host, timeout_ms, wake_waiter, &waiter))
+		return false;
+
+	pthread_mutex_lock(&waiter.lock);
+	while (!waiter.done)
+		pthread_cond_wait(&waiter.cond, &waiter.lock);
+	pthread_mutex_unlock(&waiter.lock);
+
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.lock);
+	return waiter.online;
+}
+
+const char *ping_host_name(const struct ping_host *host)
+{
+	return host->name;
+}
+
+void ping_print_stats(FILE *stream)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < host_count; i++) {
+		struct ping_host *host = hosts[i];
+
+		if (host->probes == 0)
 			continue;
-		}
-		if (c >= 76) { /* ip + icmp */
-			struct iphdr *iphdr = (struct iphdr *)receive_packet;
-
-			receive_icmp =
-				(struct icmp *)(receive_packet +
-						(iphdr->ihl
-						 << 2)); /* skip ip hdr */
-			if (receive_icmp->icmp_id == ping_packet->icmp_id &&
-			    receive_icmp->icmp_type == ICMP_ECHOREPLY)
-				received = 1;
-		}
+		fprintf(stream, "%s: %lu probes, %lu replies, last rtt %.2f ms\n",
+			host->name, host->probes, host->replies,
+			host->last_rtt_ms);
 	}
-	return received;
+	pthread_mutex_unlock(&lock);
 }
 
 void cleanup_ping()
 {
-	close(socket_fd);
-}
\ No newline at end of file
+	uint64_t one = 1;
+	unsigned int i;
+
+	if (running) {
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		if (write(event_fd, &one, sizeof(one)) < 0)
+			perror("write(eventfd)");
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+
+	for (i = 0; i < host_count; i++)
+		free(hosts[i]);
+	free(hosts);
+	hosts = NULL;
+	host_count = 0;
+	free(done_list);
+	done_list = NULL;
+	done_size = 0;
+
+	if (event_fd >= 0)
+		close(event_fd);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (socket_fd >= 0)
+		close(socket_fd);
+	if (socket6_fd >= 0)
+		close(socket6_fd);
+	event_fd = timer_fd = epoll_fd = socket_fd = socket6_fd = -1;
+}
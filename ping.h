@@ -1,8 +1,19 @@
 #ifndef ETHERWAKE_NFQUEUE_PING_H
 #define ETHERWAKE_NFQUEUE_PING_H
 
-int setup_ping(const char *hostname);
-int send_ping();
-int cleanup_ping();
+#include <stdio.h>
+
+struct ping_host;
+
+typedef void (*ping_callback)(struct ping_host *host, int online, void *arg);
+
+int setup_ping();
+struct ping_host *ping_add_host(const char *hostname);
+int ping_start(struct ping_host *host, unsigned int timeout_ms,
+	       ping_callback callback, void *arg);
+int ping_wait(struct ping_host *host, unsigned int timeout_ms);
+const char *ping_host_name(const struct ping_host *host);
+void ping_print_stats(FILE *stream);
+void cleanup_ping();
 
 #endif //ETHERWAKE_NFQUEUE_PING_H
@@ -0,0 +1,376 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE /* tm_gmtoff */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "prewake.h"
+
+/* 1970-01-01 was a Thursday */
+#define EPOCH_SLOT (3 * 24 * 3600 / PREWAKE_SLOT_S)
+#define LINE_SIZE (2 * PREWAKE_SLOTS + 64)
+
+extern int debug;
+extern int verbose;
+
+/*
+ * When a host is used, per slot of the week.  A slot counts the recent
+ * weeks it saw use: it goes up by one the first time it does in a week
+ * and is halved when it passes without.  Slots that saw use in at least
+ * PREWAKE_MIN_WEEKS recent weeks are predicted.
+ */
+struct prewake_model {
+	struct ether_addr eaddr;
+	unsigned char weeks[PREWAKE_SLOTS];
+	/* Slots with use since they last came around */
+	unsigned char seen[PREWAKE_SLOTS / 8];
+	/* Slot since the epoch the host was last woken ahead of */
+	long woken;
+	struct prewake_model *next;
+};
+
+static const char *model_path;
+static unsigned int lead_s;
+static struct prewake_model *models = NULL;
+/* Guards the list, not the counts in the models */
+static pthread_mutex_t models_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dirty = 0;
+/* Seconds east of UTC, updated by the scheduler */
+static long utc_offset = 0;
+/* Last slot since the epoch whose use was accounted for */
+static long checked;
+
+static void (*check_targets)();
+static pthread_t schedule_thread;
+static pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedule_cond = PTHREAD_COND_INITIALIZER;
+static int scheduling = 0;
+static int schedule_stopping = 0;
+
+static void update_offset()
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (localtime_r(&now, &tm) != NULL)
+		__atomic_store_n(&utc_offset, tm.tm_gmtoff, __ATOMIC_RELAXED);
+}
+
+/* Slot since the epoch in local time, SECONDS from now */
+static long local_slot(long seconds)
+{
+	return (time(NULL) + __atomic_load_n(&utc_offset, __ATOMIC_RELAXED) +
+		seconds) / PREWAKE_SLOT_S;
+}
+
+static unsigned int week_slot(long slot)
+{
+	return (slot + EPOCH_SLOT) % PREWAKE_SLOTS;
+}
+
+static struct prewake_model *add_model(const struct ether_addr *eaddr)
+{
+	struct prewake_model *model = calloc(1, sizeof(*model));
+
+	if (model == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	model->eaddr = *eaddr;
+	model->next = models;
+	models = model;
+	return model;
+}
+
+static int parse_weeks(const char *hex, unsigned char *weeks)
+{
+	unsigned int i, byte;
+
+	for (i = 0; i < PREWAKE_SLOTS; i++, hex += 2) {
+		if (sscanf(hex, "%2x", &byte) != 1)
+			return false;
+		weeks[i] = byte;
+	}
+	return *hex == '\0' || *hex == '\n';
+}
+
+static int load()
+{
+	struct ether_addr eaddr;
+	char line[LINE_SIZE], mac[18];
+	unsigned char weeks[PREWAKE_SLOTS];
+	int number = 0, offset;
+	FILE *file;
+
+	file = fopen(model_path, "r");
+	if (file == NULL) {
+		/* Nothing learned yet */
+		if (errno == ENOENT)
+			return true;
+		perror(model_path);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		struct prewake_model *model;
+
+		number++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%17s %n", mac, &offset) != 1 ||
+		    ether_aton_r(mac, &eaddr) == NULL ||
+		    ! parse_weeks(line + offset, weeks)) {
+			fprintf(stderr, "%s:%d: Ignoring invalid line\n",
+				model_path, number);
+			continue;
+		}
+		model = add_model(&eaddr);
+		if (model == NULL)
+			break;
+		memcpy(model->weeks, weeks, sizeof(weeks));
+	}
+	fclose(file);
+	return true;
+}
+
+/* Write to a new file that replaces the old one, in case we die midway */
+static void save()
+{
+	const struct prewake_model *model;
+	char tmp_path[PATH_MAX], mac[18];
+	unsigned int i;
+	FILE *file;
+
+	if (! __atomic_exchange_n(&dirty, 0, __ATOMIC_RELAXED))
+		return;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", model_path);
+	file = fopen(tmp_path, "w");
+	if (file == NULL) {
+		perror(tmp_path);
+		return;
+	}
+	fprintf(file, "# Recent weeks with use per %d minute slot from Monday "
+		"00:00, in hex\n", PREWAKE_SLOT_S / 60);
+	pthread_mutex_lock(&models_lock);
+	for (model = models; model != NULL; model = model->next) {
+		fprintf(file, "%s ", ether_ntoa_r(&model->eaddr, mac));
+		for (i = 0; i < PREWAKE_SLOTS; i++)
+			fprintf(file, "%02x", __atomic_load_n(&model->weeks[i],
+							      __ATOMIC_RELAXED));
+		fputc('\n', file);
+	}
+	pthread_mutex_unlock(&models_lock);
+
+	if (fclose(file) != 0 || rename(tmp_path, model_path) < 0) {
+		perror(model_path);
+		remove(tmp_path);
+	}
+}
+
+/* Learn from the slots that ended before SLOT */
+static void account(long slot)
+{
+	struct prewake_model *model;
+	unsigned char weeks;
+
+	/* Time we weren't running for, e.g. suspended, tells nothing, and
+	   neither does the slot we came back in, like the one we started in.
+	   The same goes for a clock that was set back. */
+	if (slot < checked || slot - checked > 2)
+		checked = slot;
+
+	pthread_mutex_lock(&models_lock);
+	for (; checked < slot - 1; checked++) {
+		unsigned int s = week_slot(checked + 1);
+		unsigned char bit = 1 << (s % 8);
+
+		for (model = models; model != NULL; model = model->next) {
+			if (__atomic_fetch_and(&model->seen[s / 8], ~bit,
+					       __ATOMIC_RELAXED) & bit)
+				continue;
+			weeks = __atomic_load_n(&model->weeks[s], __ATOMIC_RELAXED);
+			while (weeks > 0 &&
+			       ! __atomic_compare_exchange_n(&model->weeks[s],
+						&weeks, weeks / 2, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			if (weeks > 0)
+				__atomic_store_n(&dirty, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&models_lock);
+}
+
+/* Load what was learned from PATH and wake hosts LEAD seconds before
+   they are usually used */
+int prewake_open(const char *path, unsigned int lead)
+{
+	model_path = path;
+	lead_s = lead;
+	update_offset();
+	/* The slot we're in started without us */
+	checked = local_slot(0);
+	return load();
+}
+
+/* The model of the host with EADDR, shared by targets with the same one */
+struct prewake_model *prewake_model(const struct ether_addr *eaddr)
+{
+	struct prewake_model *model;
+
+	pthread_mutex_lock(&models_lock);
+	for (model = models; model != NULL; model = model->next)
+		if (memcmp(&model->eaddr, eaddr, sizeof(*eaddr)) == 0)
+			break;
+	if (model == NULL)
+		model = add_model(eaddr);
+	pthread_mutex_unlock(&models_lock);
+	return model;
+}
+
+/* Note that the host is used now, cheap after the first time in a slot */
+void prewake_record(struct prewake_model *model)
+{
+	unsigned int s;
+	unsigned char bit, weeks;
+
+	if (model == NULL)
+		return;
+
+	s = week_slot(local_slot(0));
+	bit = 1 << (s % 8);
+	if (__atomic_load_n(&model->seen[s / 8], __ATOMIC_RELAXED) & bit ||
+	    __atomic_fetch_or(&model->seen[s / 8], bit, __ATOMIC_RELAXED) & bit)
+		return;
+
+	weeks = __atomic_load_n(&model->weeks[s], __ATOMIC_RELAXED);
+	while (weeks < UCHAR_MAX &&
+	       ! __atomic_compare_exchange_n(&model->weeks[s], &weeks,
+					     weeks + 1, false, __ATOMIC_RELAXED,
+					     __ATOMIC_RELAXED))
+		;
+	__atomic_store_n(&dirty, 1, __ATOMIC_RELAXED);
+	if (debug)
+		printf("Use in slot %u, seen in %u recent weeks\n", s, weeks + 1);
+}
+
+/* Tells whether the host should be woken now, true once per slot */
+int prewake_due(struct prewake_model *model)
+{
+	long slot = local_slot(lead_s);
+
+	if (model->woken == slot ||
+	    __atomic_load_n(&model->weeks[week_slot(slot)], __ATOMIC_RELAXED) <
+		    PREWAKE_MIN_WEEKS)
+		return false;
+	model->woken = slot;
+	return true;
+}
+
+static void *schedule_main(void *data)
+{
+	struct timespec next;
+	time_t saved = time(NULL);
+
+	(void)data;
+
+	pthread_mutex_lock(&schedule_lock);
+	clock_gettime(CLOCK_REALTIME, &next);
+	while (!schedule_stopping) {
+		next.tv_sec += PREWAKE_CHECK_INTERVAL;
+		while (!schedule_stopping &&
+		       pthread_cond_timedwait(&schedule_cond, &schedule_lock,
+					      &next) != ETIMEDOUT)
+			;
+		if (schedule_stopping)
+			break;
+		pthread_mutex_unlock(&schedule_lock);
+
+		/* Daylight saving time may have started */
+		update_offset();
+		account(local_slot(0));
+		check_targets();
+		if (time(NULL) - saved >= PREWAKE_SAVE_INTERVAL) {
+			save();
+			saved = time(NULL);
+		}
+
+		pthread_mutex_lock(&schedule_lock);
+	}
+	pthread_mutex_unlock(&schedule_lock);
+	return NULL;
+}
+
+/* Call CHECK every PREWAKE_CHECK_INTERVAL seconds to wake the targets that
+   are due */
+int prewake_start(void (*check)())
+{
+	sigset_t all, old;
+	int ret;
+
+	check_targets = check;
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&schedule_thread, NULL, schedule_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating prewake thread\n");
+		return false;
+	}
+	scheduling = 1;
+	return true;
+}
+
+/* Stop waking hosts and save what was learned */
+void prewake_close()
+{
+	struct prewake_model *model, *next;
+
+	if (model_path == NULL)
+		return;
+
+	if (scheduling) {
+		pthread_mutex_lock(&schedule_lock);
+		schedule_stopping = 1;
+		pthread_cond_signal(&schedule_cond);
+		pthread_mutex_unlock(&schedule_lock);
+		pthread_join(schedule_thread, NULL);
+		scheduling = 0;
+	}
+
+	account(local_slot(0));
+	save();
+
+	pthread_mutex_lock(&models_lock);
+	for (model = models; model != NULL; model = next) {
+		next = model->next;
+		free(model);
+	}
+	models = NULL;
+	pthread_mutex_unlock(&models_lock);
+	model_path = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef ETHERWAKE_NFQUEUE_PREWAKE_H
+#define ETHERWAKE_NFQUEUE_PREWAKE_H
+
+#include <netinet/ether.h>
+
+/* A week in slots of PREWAKE_SLOT_S seconds, starting Monday 00:00 local
+   time */
+#define PREWAKE_SLOT_S 900
+#define PREWAKE_SLOTS (7 * 24 * 3600 / PREWAKE_SLOT_S)
+/* Seconds between checks for hosts to wake ahead of time */
+#define PREWAKE_CHECK_INTERVAL 60
+/* Seconds between saves of what was learned */
+#define PREWAKE_SAVE_INTERVAL 3600
+/* Recent weeks a slot needs to have seen use to be predicted */
+#define PREWAKE_MIN_WEEKS 2
+#define DEFAULT_PREWAKE_LEAD_S 300
+
+struct prewake_model;
+
+int prewake_open(const char *path, unsigned int lead_s);
+struct prewake_model *prewake_model(const struct ether_addr *eaddr);
+void prewake_record(struct prewake_model *model);
+int prewake_due(struct prewake_model *model);
+int prewake_start(void (*check)());
+void prewake_close();
+
+#endif //ETHERWAKE_NFQUEUE_PREWAKE_H
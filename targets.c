@@ -0,0 +1,625 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include "targets.h"
+#include "links.h"
+#include "metrics.h"
+
+#define MIN_SLOTS 64
+
+#define STATE_OF(word) ((int)((word) & 3))
+#define SINCE_OF(word) ((word) >> 2)
+#define STATE_WORD(state, ms) ((uint64_t)(ms) << 2 | (state))
+
+static const char *state_names[] = { "asleep", "waking", "awake" };
+
+static unsigned int waking_cooldown_ms = DEFAULT_WAKING_COOLDOWN_MS;
+static unsigned int awake_cooldown_ms = DEFAULT_AWAKE_COOLDOWN_MS;
+
+/*
+ * Targets are kept in an open addressing hash table keyed by their IP
+ * address, which is looked up with the destination address of every queued
+ * packet.  The table is never changed once published.  Updates build a new
+ * one and swap the pointer, so lookups don't take a lock.
+ */
+struct target_table {
+	size_t count;
+	/* Number of slots minus one, at most half of them are used */
+	size_t mask;
+	struct target *slots[];
+};
+
+static struct target_table *table = NULL;
+
+/*
+ * Each thread looking up targets announces the generation of the table it
+ * reads.  Before an old table is freed, the writer waits for the threads
+ * that may still read it.
+ */
+struct reader {
+	/* 0 outside of lookups */
+	uint64_t generation;
+	unsigned int depth;
+	struct reader *next;
+};
+
+static __thread struct reader *self = NULL;
+static struct reader *readers = NULL;
+static uint64_t generation = 1;
+
+/* Serializes updates */
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+static uint32_t hash_addr(int family, const unsigned char *addr)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u ^ (uint32_t)family;
+	size_t i;
+
+	for (i = 0; i < addr_len(family); i++) {
+		hash ^= addr[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct reader *add_reader()
+{
+	struct reader *r = calloc(1, sizeof(*r));
+
+	if (r == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	r->next = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&readers, &r->next, r, false,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		;
+	return r;
+}
+
+/* Returns the current table, which stays valid until read_end() */
+static const struct target_table *read_begin()
+{
+	if (self == NULL && (self = add_reader()) == NULL)
+		return NULL;
+
+	if (self->depth++ == 0) {
+		__atomic_store_n(&self->generation,
+				 __atomic_load_n(&generation, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELAXED);
+		/* Pairs with the fence in publish() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+}
+
+static void read_end()
+{
+	if (self != NULL && --self->depth == 0)
+		__atomic_store_n(&self->generation, 0, __ATOMIC_RELEASE);
+}
+
+/* Replace the table and free the old one once no lookup uses it anymore.
+   Called with update_lock held. */
+static void publish(struct target_table *new_table)
+{
+	struct target_table *old;
+	struct reader *r;
+	uint64_t gen;
+
+	old = __atomic_exchange_n(&table, new_table, __ATOMIC_SEQ_CST);
+	gen = __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL;
+	     r = r->next) {
+		uint64_t g;
+
+		while ((g = __atomic_load_n(&r->generation, __ATOMIC_ACQUIRE)) &&
+		       g < gen)
+			sched_yield();
+	}
+	free(old);
+}
+
+static struct target **find_slot(const struct target_table *t, int family,
+				 const void *addr)
+{
+	size_t i = hash_addr(family, addr) & t->mask;
+	struct target **slot;
+
+	for (;; i = (i + 1) & t->mask) {
+		slot = (struct target **)&t->slots[i];
+		if (*slot == NULL || ((*slot)->family == family &&
+				      memcmp((*slot)->addr, addr,
+					     addr_len(family)) == 0))
+			return slot;
+	}
+}
+
+/* A copy of the current table with room for COUNT targets, without the one
+   at EXCEPT */
+static struct target_table *copy_table(size_t count, const struct target *except)
+{
+	struct target_table *new_table;
+	size_t slots = MIN_SLOTS, i;
+
+	while (slots < count * 2)
+		slots *= 2;
+	new_table = calloc(1, sizeof(*new_table) + slots * sizeof(*table->slots));
+	if (new_table == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	new_table->mask = slots - 1;
+
+	for (i = 0; table != NULL && i <= table->mask; i++) {
+		struct target *t = table->slots[i];
+
+		if (t == NULL || t == except)
+			continue;
+		*find_slot(new_table, t->family, t->addr) = t;
+		new_table->count++;
+	}
+	return new_table;
+}
+
+/* Returns the target with a reference, to be dropped with target_put().
+   Taken before the lookup ends, so a table published meanwhile doesn't
+   free it. */
+struct target *targets_lookup(int family, const void *addr)
+{
+	const struct target_table *t = read_begin();
+	struct target *target = NULL;
+
+	if (t != NULL && t->count > 0)
+		target = *find_slot(t, family, addr);
+	if (target != NULL)
+		target_get(target);
+	read_end();
+	return target;
+}
+
+struct target *target_new(int family, const void *addr,
+			  const struct ether_addr *eaddr)
+{
+	struct target *t = calloc(1, sizeof(*t));
+
+	if (t == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	t->family = family;
+	memcpy(t->addr, addr, addr_len(family));
+	t->eaddr = *eaddr;
+	/* Passed on to the table */
+	t->refs = 1;
+	return t;
+}
+
+/*
+ * Targets are freed once the last reference is dropped.  The table holds
+ * one, lookups return one, parked packets, queued wake-ups and running
+ * probes hold one each, and a replaced target holds one on the target
+ * that replaced it.
+ */
+struct target *target_get(struct target *target)
+{
+	__atomic_add_fetch(&target->refs, 1, __ATOMIC_RELAXED);
+	return target;
+}
+
+void target_put(struct target *target)
+{
+	struct target *next;
+
+	while (target != NULL &&
+	       __atomic_sub_fetch(&target->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		next = target->replaced_by;
+		free(target);
+		target = next;
+	}
+}
+
+/* A new target configured like OLD, to replace it with changes.  The
+   packet is left to be built again. */
+struct target *target_clone(const struct target *old)
+{
+	struct target *t = target_new(old->family, old->addr, &old->eaddr);
+
+	if (t == NULL)
+		return NULL;
+	t->udp_dest = old->udp_dest;
+	t->link = old->link;
+	memcpy(t->passwd, old->passwd, sizeof(t->passwd));
+	t->passwd_size = old->passwd_size;
+	t->ping_host = old->ping_host;
+	t->neigh_host = old->neigh_host;
+	t->model = old->model;
+	return t;
+}
+
+/* Publish a table with TARGET, which may replace one with the same
+   address.  Returns false for a duplicate unless REPLACE is set. */
+static int insert(struct target *target, int replace)
+{
+	struct target_table *new_table;
+	struct target *old;
+	size_t count;
+
+	pthread_mutex_lock(&update_lock);
+	count = table ? table->count : 0;
+	old = table ? *find_slot(table, target->family, target->addr) : NULL;
+	if (old != NULL && !replace) {
+		pthread_mutex_unlock(&update_lock);
+		fprintf(stderr, "Duplicate target address\n");
+		return false;
+	}
+
+	new_table = copy_table(count + 1, old);
+	if (new_table == NULL) {
+		pthread_mutex_unlock(&update_lock);
+		return false;
+	}
+	*find_slot(new_table, target->family, target->addr) = target;
+	new_table->count++;
+
+	if (old != NULL) {
+		/* The host didn't go anywhere, neither did its state */
+		target->state = __atomic_load_n(&old->state, __ATOMIC_ACQUIRE);
+		target->triggers = old->triggers;
+		target->wakes = old->wakes;
+		target->suppressed = old->suppressed;
+		target->attempts = old->attempts;
+		target->wake_ms = old->wake_ms;
+		target->attempt_ms = old->attempt_ms;
+		/* A probe running for OLD is handed over.  Its end either
+		   happened before the second check or sees TARGET, see
+		   target_probe_ended(). */
+		target->probing = __atomic_load_n(&old->probing,
+						  __ATOMIC_SEQ_CST);
+		__atomic_store_n(&old->replaced_by, target_get(target),
+				 __ATOMIC_SEQ_CST);
+		if (! __atomic_load_n(&old->probing, __ATOMIC_SEQ_CST))
+			__atomic_store_n(&target->probing, 0, __ATOMIC_SEQ_CST);
+	}
+	publish(new_table);
+	/* No lookup can find OLD anymore, drop the table's reference */
+	if (old != NULL)
+		target_put(old);
+	pthread_mutex_unlock(&update_lock);
+	return true;
+}
+
+int targets_add(struct target *target)
+{
+	return insert(target, false);
+}
+
+/* Add COUNT targets with a single table copy, e.g. thousands on startup.
+   Nothing is added unless all of them are. */
+int targets_add_many(struct target **targets, size_t count)
+{
+	struct target_table *new_table;
+	struct target **slot;
+	char addr[INET6_ADDRSTRLEN];
+	size_t i;
+
+	pthread_mutex_lock(&update_lock);
+	new_table = copy_table((table ? table->count : 0) + count, NULL);
+	if (new_table == NULL) {
+		pthread_mutex_unlock(&update_lock);
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		slot = find_slot(new_table, targets[i]->family, targets[i]->addr);
+		if (*slot != NULL) {
+			pthread_mutex_unlock(&update_lock);
+			free(new_table);
+			inet_ntop(targets[i]->family, targets[i]->addr, addr,
+				  sizeof(addr));
+			fprintf(stderr, "Duplicate target address %s\n", addr);
+			return false;
+		}
+		*slot = targets[i];
+		new_table->count++;
+	}
+	publish(new_table);
+	pthread_mutex_unlock(&update_lock);
+	return true;
+}
+
+/* Add TARGET or replace the one with its address, taking over its state */
+int targets_replace(struct target *target)
+{
+	return insert(target, true);
+}
+
+int targets_remove(int family, const void *addr)
+{
+	struct target_table *new_table;
+	struct target *old;
+
+	pthread_mutex_lock(&update_lock);
+	old = table ? *find_slot(table, family, addr) : NULL;
+	if (old == NULL) {
+		pthread_mutex_unlock(&update_lock);
+		return false;
+	}
+
+	new_table = copy_table(table->count - 1, old);
+	if (new_table == NULL) {
+		pthread_mutex_unlock(&update_lock);
+		return false;
+	}
+	publish(new_table);
+	target_put(old);
+	pthread_mutex_unlock(&update_lock);
+	return true;
+}
+
+/* Look up the target by the destination address of an IPv4 or IPv6 header */
+struct target *targets_lookup_packet(const unsigned char *packet, size_t len)
+{
+	if (len < 1)
+		return NULL;
+
+	switch (packet[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return NULL;
+		return targets_lookup(AF_INET, packet + 16);
+	case 6:
+		if (len < 40)
+			return NULL;
+		return targets_lookup(AF_INET6, packet + 24);
+	}
+	return NULL;
+}
+
+size_t targets_count()
+{
+	const struct target_table *t = read_begin();
+	size_t count = t ? t->count : 0;
+
+	read_end();
+	return count;
+}
+
+/* Stops at and returns the first non-zero result of FN, which must not
+   add, replace or remove targets.  FN takes a reference on targets it
+   keeps. */
+int targets_for_each(int (*fn)(struct target *target))
+{
+	const struct target_table *t = read_begin();
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; t != NULL && i <= t->mask && ret == 0; i++)
+		if (t->slots[i] != NULL)
+			ret = fn(t->slots[i]);
+	read_end();
+	return ret;
+}
+
+/* Replaced targets still referenced after all threads stopped go with
+   the process */
+void targets_cleanup()
+{
+	struct reader *r, *next_reader;
+	size_t i;
+
+	for (i = 0; table != NULL && i <= table->mask; i++)
+		target_put(table->slots[i]);
+	free(table);
+	table = NULL;
+	for (r = readers; r != NULL; r = next_reader) {
+		next_reader = r->next;
+		free(r);
+	}
+	readers = NULL;
+	self = NULL;
+}
+
+static uint64_t now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t elapsed_ms(uint64_t word, uint64_t now)
+{
+	/* Another thread may have entered the state after NOW was taken */
+	return now > SINCE_OF(word) ? now - SINCE_OF(word) : 0;
+}
+
+void targets_set_cooldown(unsigned int waking_ms, unsigned int awake_ms)
+{
+	/* May change at runtime, see the control socket */
+	__atomic_store_n(&waking_cooldown_ms, waking_ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&awake_cooldown_ms, awake_ms, __ATOMIC_RELAXED);
+}
+
+/*
+ * Decide whether a packet for TARGET should send a magic packet.  Only one
+ * of several concurrent callers gets TRIGGER_WAKE per cool-down, which puts
+ * the target into the waking state until target_woken() is called.
+ */
+int target_trigger(struct target *target)
+{
+	uint64_t now = now_ms();
+	uint64_t word = __atomic_load_n(&target->state, __ATOMIC_ACQUIRE);
+	int ret;
+
+	__atomic_add_fetch(&target->triggers, 1, __ATOMIC_RELAXED);
+
+	do {
+		ret = TRIGGER_WAKE;
+		if (STATE_OF(word) == TARGET_WAKING &&
+		    elapsed_ms(word, now) <
+		    __atomic_load_n(&waking_cooldown_ms, __ATOMIC_RELAXED))
+			ret = TRIGGER_SUPPRESSED;
+		else if (STATE_OF(word) == TARGET_AWAKE &&
+			 elapsed_ms(word, now) <
+			 __atomic_load_n(&awake_cooldown_ms, __ATOMIC_RELAXED))
+			ret = TRIGGER_AWAKE;
+
+		if (ret != TRIGGER_WAKE) {
+			__atomic_add_fetch(&target->suppressed, 1,
+					   __ATOMIC_RELAXED);
+			return ret;
+		}
+	} while (!__atomic_compare_exchange_n(&target->state, &word,
+					      STATE_WORD(TARGET_WAKING, now),
+					      false, __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+
+	__atomic_add_fetch(&target->wakes, 1, __ATOMIC_RELAXED);
+	return TRIGGER_WAKE;
+}
+
+/* The target that replaced TARGET, or TARGET itself */
+struct target *target_current(struct target *target)
+{
+	struct target *next;
+
+	while ((next = __atomic_load_n(&target->replaced_by,
+				       __ATOMIC_SEQ_CST)) != NULL)
+		target = next;
+	return target;
+}
+
+/* The probe started for TARGET ended, for the targets replacing it too.
+   Drops the reference the probe held. */
+void target_probe_ended(struct target *target)
+{
+	struct target *t;
+
+	for (t = target; t != NULL;
+	     t = __atomic_load_n(&t->replaced_by, __ATOMIC_SEQ_CST))
+		__atomic_store_n(&t->probing, 0, __ATOMIC_SEQ_CST);
+	target_put(target);
+}
+
+/* Record whether the target responded after being woken */
+void target_woken(struct target *target, int online)
+{
+	uint64_t now = now_ms();
+	uint64_t word;
+
+	word = __atomic_exchange_n(&target->state,
+				   STATE_WORD(online ? TARGET_AWAKE :
+					      TARGET_ASLEEP, now),
+				   __ATOMIC_ACQ_REL);
+	if (online && STATE_OF(word) == TARGET_WAKING)
+		metrics_record(METRIC_WAKE, elapsed_ms(word, now) * 1000000);
+}
+
+int target_is_awake(struct target *target)
+{
+	uint64_t word = __atomic_load_n(&target->state, __ATOMIC_ACQUIRE);
+
+	return STATE_OF(word) == TARGET_AWAKE &&
+		elapsed_ms(word, now_ms()) <
+		__atomic_load_n(&awake_cooldown_ms, __ATOMIC_RELAXED);
+}
+
+static void print_target(FILE *stream, struct target *target)
+{
+	uint64_t word = __atomic_load_n(&target->state, __ATOMIC_RELAXED);
+	char addr[INET6_ADDRSTRLEN] = "";
+	char mac[18];
+
+	if (target->family != 0)
+		inet_ntop(target->family, target->addr, addr, sizeof(addr));
+	fprintf(stream, "%s%s%s%s%s: %s, %lu triggers, %lu magic packets, "
+		"%lu suppressed\n", ether_ntoa_r(&target->eaddr, mac),
+		*addr ? " " : "", addr, target->link ? " on " : "",
+		target->link ? link_name(target->link) : "",
+		state_names[STATE_OF(word)],
+		__atomic_load_n(&target->triggers, __ATOMIC_RELAXED),
+		__atomic_load_n(&target->wakes, __ATOMIC_RELAXED),
+		__atomic_load_n(&target->suppressed, __ATOMIC_RELAXED));
+}
+
+void target_print_stats(FILE *stream, struct target *target)
+{
+	if (__atomic_load_n(&target->triggers, __ATOMIC_RELAXED) != 0)
+		print_target(stream, target);
+}
+
+void target_add_totals(struct target *target, struct target_totals *totals)
+{
+	totals->triggers +=
+		__atomic_load_n(&target->triggers, __ATOMIC_RELAXED);
+	totals->wakes += __atomic_load_n(&target->wakes, __ATOMIC_RELAXED);
+	totals->suppressed +=
+		__atomic_load_n(&target->suppressed, __ATOMIC_RELAXED);
+}
+
+void targets_get_totals(struct target_totals *totals)
+{
+	const struct target_table *t = read_begin();
+	size_t i;
+
+	for (i = 0; t != NULL && i <= t->mask; i++)
+		if (t->slots[i] != NULL)
+			target_add_totals(t->slots[i], totals);
+	read_end();
+}
+
+/* With ALL, targets that weren't triggered yet are included */
+static void print_targets(FILE *stream, int all)
+{
+	const struct target_table *t = read_begin();
+	size_t i;
+
+	for (i = 0; t != NULL && i <= t->mask; i++)
+		if (t->slots[i] != NULL && all)
+			print_target(stream, t->slots[i]);
+		else if (t->slots[i] != NULL)
+			target_print_stats(stream, t->slots[i]);
+	read_end();
+}
+
+void targets_print_stats(FILE *stream)
+{
+	print_targets(stream, false);
+}
+
+void targets_print(FILE *stream)
+{
+	print_targets(stream, true);
+}
@@ -0,0 +1,111 @@
+#ifndef ETHERWAKE_NFQUEUE_TARGETS_H
+#define ETHERWAKE_NFQUEUE_TARGETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#define TARGET_PACKET_SIZE 128
+/* Time between magic packets to a target that didn't respond yet */
+#define DEFAULT_WAKING_COOLDOWN_MS 10000
+/* Time a target is assumed to stay awake after it responded */
+#define DEFAULT_AWAKE_COOLDOWN_MS 60000
+
+struct ping_host;
+struct neigh_host;
+struct prewake_model;
+struct link;
+
+/* Wake state of a target */
+enum {
+	TARGET_ASLEEP,
+	TARGET_WAKING,
+	TARGET_AWAKE
+};
+
+/* What a packet for a target leads to, see target_trigger() */
+enum {
+	TRIGGER_WAKE,		/* Send a magic packet */
+	TRIGGER_SUPPRESSED,	/* Woken within the cool-down already */
+	TRIGGER_AWAKE		/* Known to be awake */
+};
+
+struct target {
+	int family; /* AF_INET or AF_INET6 */
+	unsigned char addr[16];
+	struct ether_addr eaddr;
+	u_char packet[TARGET_PACKET_SIZE];
+	int packet_size;
+	/* Where the packet goes when sent over UDP */
+	struct sockaddr_in udp_dest;
+	/* Interface the packet goes out on and the host is probed on, not
+	   set with '-U' unless probing with '-N' */
+	struct link *link;
+	/* Replaces the global password when set */
+	u_char passwd[6];
+	int passwd_size;
+	/* Shared between receive and wake threads, accessed atomically.
+	   The wake state and the monotonic time in ms it was entered are
+	   packed into one word, so transitions are a single CAS. */
+	uint64_t state;
+	/* Set while the target is probed */
+	int probing;
+	/* Magic packets sent while probing, when the first and the last one
+	   went out, see hold.c */
+	unsigned int attempts;
+	uint64_t wake_ms;
+	uint64_t attempt_ms;
+	unsigned long triggers;
+	unsigned long wakes;
+	unsigned long suppressed;
+	/* Liveness probe, only set when holding packets */
+	struct ping_host *ping_host;
+	struct neigh_host *neigh_host;
+	/* Learned times of use, only set with '-L' */
+	struct prewake_model *model;
+	/* Set once the target was replaced, a probe still running for it
+	   continues with the newer one */
+	struct target *replaced_by;
+	/* References, see target_get() */
+	unsigned int refs;
+};
+
+/* Counters summed over targets, for the metrics export */
+struct target_totals {
+	unsigned long triggers;
+	unsigned long wakes;
+	unsigned long suppressed;
+};
+
+struct target *target_new(int family, const void *addr,
+			  const struct ether_addr *eaddr);
+struct target *target_clone(const struct target *old);
+struct target *target_get(struct target *target);
+void target_put(struct target *target);
+int targets_add(struct target *target);
+int targets_add_many(struct target **targets, size_t count);
+int targets_replace(struct target *target);
+int targets_remove(int family, const void *addr);
+struct target *targets_lookup(int family, const void *addr);
+struct target *targets_lookup_packet(const unsigned char *packet, size_t len);
+size_t targets_count();
+int targets_for_each(int (*fn)(struct target *target));
+void targets_cleanup();
+
+void targets_set_cooldown(unsigned int waking_ms, unsigned int awake_ms);
+int target_trigger(struct target *target);
+void target_woken(struct target *target, int online);
+struct target *target_current(struct target *target);
+void target_probe_ended(struct target *target);
+int target_is_awake(struct target *target);
+void target_print_stats(FILE *stream, struct target *target);
+void targets_print_stats(FILE *stream);
+void targets_print(FILE *stream);
+void target_add_totals(struct target *target, struct target_totals *totals);
+void targets_get_totals(struct target_totals *totals);
+
+#endif //ETHERWAKE_NFQUEUE_TARGETS_H
@@ -0,0 +1,207 @@
+/*
+ * This file is part of etherwake-nfqueue
+ * (https://github.com/mister-benjamin/etherwake-nfqueue)
+ *
+ * Copyright (C) 2019 Mister Benjamin <144dbspl@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/eventfd.h>
+
+#include "wake.h"
+
+/* Must be a power of two */
+#define QUEUE_SIZE 256
+/* Most requests handed to the callback at once */
+#define BATCH_SIZE 64
+
+extern int debug;
+
+/*
+ * Bounded lock-free MPMC ring (Vyukov). Every cell carries a sequence
+ * number telling producers and the consumer whose turn it is, so
+ * the receive path never takes a lock or blocks on the wake thread.
+ */
+struct cell {
+	unsigned long sequence;
+	void *arg;
+};
+
+static struct cell queue[QUEUE_SIZE];
+static unsigned long enqueue_pos;
+static unsigned long dequeue_pos;
+
+static int event_fd = -1;
+static int stopping = 0;
+static unsigned long dropped = 0;
+static pthread_t thread;
+static int (*wake_callback)(void **args, unsigned int count);
+
+static bool queue_push(void *arg)
+{
+	struct cell *cell;
+	unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &queue[pos & (QUEUE_SIZE - 1)];
+		unsigned long seq =
+			__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		long diff = (long)seq - (long)pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&enqueue_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false; /* full */
+		} else {
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->arg = arg;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool queue_pop(void **arg)
+{
+	struct cell *cell;
+	unsigned long pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &queue[pos & (QUEUE_SIZE - 1)];
+		unsigned long seq =
+			__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		long diff = (long)seq - (long)(pos + 1);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&dequeue_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false; /* empty */
+		} else {
+			pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	*arg = cell->arg;
+	__atomic_store_n(&cell->sequence, pos + QUEUE_SIZE, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *wake_thread(void *data)
+{
+	void *args[BATCH_SIZE];
+	unsigned int count;
+	uint64_t events;
+
+	(void)data;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (read(event_fd, &events, sizeof(events)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read(eventfd)");
+			break;
+		}
+
+		/* Requests queued meanwhile are handled together */
+		do {
+			count = 0;
+			while (count < BATCH_SIZE && queue_pop(&args[count]))
+				count++;
+			if (count > 0)
+				wake_callback(args, count);
+		} while (count == BATCH_SIZE);
+	}
+
+	return NULL;
+}
+
+int wake_start(int (*callback)(void **args, unsigned int count))
+{
+	sigset_t all, old;
+	unsigned long i;
+	int ret;
+
+	for (i = 0; i < QUEUE_SIZE; i++)
+		queue[i].sequence = i;
+	enqueue_pos = dequeue_pos = 0;
+	wake_callback = callback;
+
+	event_fd = eventfd(0, EFD_CLOEXEC);
+	if (event_fd < 0) {
+		perror("eventfd");
+		return false;
+	}
+
+	/* Signals are left to the receiving threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, wake_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		fprintf(stderr, "Failed creating wake thread\n");
+		close(event_fd);
+		return false;
+	}
+
+	return true;
+}
+
+/* Called on the receive path: never blocks, drops the request when full */
+int wake_enqueue(void *arg)
+{
+	uint64_t one = 1;
+
+	if (!queue_push(arg)) {
+		unsigned long n =
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		if (debug)
+			printf("Wake queue full, %lu requests dropped\n", n);
+		return false;
+	}
+
+	if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write(eventfd)");
+
+	return true;
+}
+
+void wake_stop()
+{
+	uint64_t one = 1;
+
+	if (event_fd < 0)
+		return;
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	if (write(event_fd, &one, sizeof(one)) < 0)
+		perror("write(eventfd)");
+	pthread_join(thread, NULL);
+	close(event_fd);
+	event_fd = -1;
+}
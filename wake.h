@@ -0,0 +1,9 @@
+#ifndef ETHERWAKE_NFQUEUE_WAKE_H
+#define ETHERWAKE_NFQUEUE_WAKE_H
+
+/* CALLBACK gets all requests queued since it was last called, in batches */
+int wake_start(int (*callback)(void **args, unsigned int count));
+int wake_enqueue(void *arg);
+void wake_stop();
+
+#endif //ETHERWAKE_NFQUEUE_WAKE_H